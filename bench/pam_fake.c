@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+
+#include <security/pam_appl.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Fake pam(3), where any user authenticates by the password 
+ * denoted by SOD_FAKE_PAM_PW, "secret" by default. The cost of 
+ * password hashing is emulated by SOD_FAKE_PAM_DELAY microseconds.
+ */
+
+#define SOD_FAKE_PAM_PW_ENV     "SOD_FAKE_PAM_PW"
+#define SOD_FAKE_PAM_DELAY_ENV     "SOD_FAKE_PAM_DELAY"
+#define SOD_FAKE_PAM_PW_DFLT     "secret"
+
+struct pam_handle {
+    struct pam_conv     ph_conv;
+};
+
+static int     pam_fake_ask(pam_handle_t *, char **);
+static void     pam_fake_delay(void);
+
+int
+pam_start(const char *service __unused, const char *user __unused, 
+        const struct pam_conv *conv, pam_handle_t **pamh)
+{
+    
+    if ((*pamh = calloc(1, sizeof(**pamh))) == NULL)
+        return (PAM_PERM_DENIED);
+    
+    (*pamh)->ph_conv = *conv;
+    
+    return (PAM_SUCCESS);
+}
+
+int
+pam_end(pam_handle_t *pamh, int status __unused)
+{
+    
+    free(pamh);
+    
+    return (PAM_SUCCESS);
+}
+
+int
+pam_set_item(pam_handle_t *pamh __unused, int item __unused, 
+        const void *arg __unused)
+{
+    
+    return (PAM_SUCCESS);
+}
+
+int
+pam_authenticate(pam_handle_t *pamh, int flags __unused)
+{
+    const char *pw;
+    char *tok;
+    int pam_err;
+    
+    if ((pw = getenv(SOD_FAKE_PAM_PW_ENV)) == NULL)
+        pw = SOD_FAKE_PAM_PW_DFLT;
+    
+    if ((pam_err = pam_fake_ask(pamh, &tok)) != PAM_SUCCESS)
+        return (pam_err);
+    
+    pam_fake_delay();
+    
+    pam_err = (strcmp(tok, pw) == 0) ? PAM_SUCCESS : PAM_AUTH_ERR;
+    
+    free(tok);
+    
+    return (pam_err);
+}
+
+int
+pam_chauthtok(pam_handle_t *pamh, int flags __unused)
+{
+    char *tok;
+    int pam_err;
+    
+    if ((pam_err = pam_fake_ask(pamh, &tok)) != PAM_SUCCESS)
+        return (pam_err);
+    
+    pam_fake_delay();
+    
+    free(tok);
+    
+    return (PAM_SUCCESS);
+}
+
+/*
+ * Request PAM_AUTHTOK by conversation routine.
+ */
+static int
+pam_fake_ask(pam_handle_t *pamh, char **tok)
+{
+    struct pam_message msg, *msgp;
+    struct pam_response *resp = NULL;
+    int pam_err;
+    
+    msg.msg_style = PAM_PROMPT_ECHO_OFF;
+    msg.msg = "Password:";
+    msgp = &msg;
+    
+    pam_err = (*pamh->ph_conv.conv)(1, (const struct pam_message **)&msgp, 
+        &resp, pamh->ph_conv.appdata_ptr);
+    
+    if (pam_err != PAM_SUCCESS)
+        return (pam_err);
+    
+    if (resp == NULL || resp[0].resp == NULL) {
+        free(resp);
+        return (PAM_CONV_ERR);
+    }
+    *tok = resp[0].resp;
+    free(resp);
+    
+    return (PAM_SUCCESS);
+}
+
+static void
+pam_fake_delay(void)
+{
+    const char *s;
+    long usec;
+    
+    if ((s = getenv(SOD_FAKE_PAM_DELAY_ENV)) == NULL)
+        return;
+    
+    if ((usec = strtol(s, NULL, 10)) > 0)
+        (void)usleep((useconds_t)usec);
+}
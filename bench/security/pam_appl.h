@@ -0,0 +1,80 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+/*
+ * Subset of pam(3), as used by sod(8), for benchmarks on
+ * hosts without pam(3). Values are those of Linux-PAM.
+ */
+
+#ifndef _SOD_BENCH_PAM_APPL_H_
+#define    _SOD_BENCH_PAM_APPL_H_
+
+#include <sys/cdefs.h>
+
+#define PAM_SUCCESS     0
+#define PAM_PERM_DENIED     6
+#define PAM_AUTH_ERR     7
+#define PAM_USER_UNKNOWN     10
+#define PAM_CONV_ERR     19
+
+#define PAM_TTY     3
+#define PAM_RHOST     4
+#define PAM_RUSER     8
+
+#define PAM_PROMPT_ECHO_OFF     1
+#define PAM_PROMPT_ECHO_ON     2
+#define PAM_ERROR_MSG     3
+#define PAM_TEXT_INFO     4
+
+typedef struct pam_handle     pam_handle_t;
+
+struct pam_message {
+    int     msg_style;
+    const char     *msg;
+};
+
+struct pam_response {
+    char     *resp;
+    int     resp_retcode;
+};
+
+struct pam_conv {
+    int     (*conv)(int, const struct pam_message **, 
+        struct pam_response **, void *);
+    void     *appdata_ptr;
+};
+
+__BEGIN_DECLS
+int     pam_start(const char *, const char *, const struct pam_conv *, 
+    pam_handle_t **);
+int     pam_end(pam_handle_t *, int);
+int     pam_set_item(pam_handle_t *, int, const void *);
+int     pam_authenticate(pam_handle_t *, int);
+int     pam_chauthtok(pam_handle_t *, int);
+__END_DECLS
+
+#endif /* _SOD_BENCH_PAM_APPL_H_ */
@@ -0,0 +1,648 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <security/pam_appl.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "sod_var.h"
+
+/*
+ * Benchmarks of libsod and sod(8).
+ *
+ * By default, micro-benchmarks of message primitives and of 
+ * sod_conv() are performed, where sod_conv() is called as by 
+ * fake pam(3). By -e, transactions are performed end-to-end by 
+ * sod(8) listening on the denoted socket. Results are written 
+ * as one line of key=value pairs per benchmark.
+ */
+
+#define SOD_BENCH_ITER_DFLT     100000
+#define SOD_BENCH_TXN_DFLT     1000
+#define SOD_BENCH_CONC_DFLT     4
+#define SOD_BENCH_USER_DFLT     "nobody"
+#define SOD_BENCH_PW_DFLT     "secret"
+
+#define SOD_BENCH_AUDIT_BURST     2048     /* half of audit queue */
+#define SOD_BENCH_AUDIT_ROUNDS     8
+#define SOD_BENCH_AUDIT_PAUSE     250000     /* usec, drained by logger */
+
+struct sod_bench_thr {
+    pthread_t     bt_tid;
+    int     bt_s;     /* socket, if micro-benchmark */
+    long     bt_ntxn;
+    long     bt_failed;
+    int64_t     *bt_lat;     /* usec, by transaction */
+};
+
+static long     sod_bench_iter = SOD_BENCH_ITER_DFLT;
+static int     sod_bench_ring;
+static const char     *sod_bench_user = SOD_BENCH_USER_DFLT;
+static const char     *sod_bench_pw = SOD_BENCH_PW_DFLT;
+
+static struct sockaddr_storage     sap;
+static struct sockaddr_un *sun;
+static size_t len;
+
+static void     sod_bench_prepare(void);
+static void     sod_bench_sendrecv(void);
+static void     sod_bench_pingpong(int);
+static void     sod_bench_conv(int);
+static void     sod_bench_audit(void);
+static void     sod_bench_e2e(long, int);
+static void *     sod_bench_echo(void *);
+static void *     sod_bench_applicant(void *);
+static void *     sod_bench_client(void *);
+static int     sod_bench_auth(int, struct sod_ring *);
+static void     sod_bench_report(const char *, const char *, long, uint64_t);
+static int     sod_bench_i64cmp(const void *, const void *);
+static void     sod_bench_usage(void);
+
+int
+main(int argc, char **argv)
+{
+    const char *path = NULL;
+    long ntxn = SOD_BENCH_TXN_DFLT;
+    int ch, conc = SOD_BENCH_CONC_DFLT;
+    char *ep;
+    
+    while ((ch = getopt(argc, argv, "Rc:e:i:n:p:u:")) != -1) {
+        switch (ch) {
+        case 'R':
+            sod_bench_ring = 1;
+            break;
+        case 'c':
+            conc = (int)strtol(optarg, &ep, 10);
+            
+            if (*optarg == '\0' || *ep != '\0' || conc < 1)
+                sod_bench_usage();
+            break;
+        case 'e':
+            path = optarg;
+            break;
+        case 'i':
+            sod_bench_iter = strtol(optarg, &ep, 10);
+            
+            if (*optarg == '\0' || *ep != '\0' || sod_bench_iter < 1)
+                sod_bench_usage();
+            break;
+        case 'n':
+            ntxn = strtol(optarg, &ep, 10);
+            
+            if (*optarg == '\0' || *ep != '\0' || ntxn < 1)
+                sod_bench_usage();
+            break;
+        case 'p':
+            sod_bench_pw = optarg;
+            break;
+        case 'u':
+            sod_bench_user = optarg;
+            break;
+        default:
+            sod_bench_usage();
+            break;
+        }
+    }
+    
+    if (argc != optind)
+        sod_bench_usage();
+    
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        err(EX_OSERR, "Can't disable SIGPIPE");
+    
+    if (path != NULL) {
+        (void)memset(&sap, 0, sizeof(sap));
+        
+        sun = (struct sockaddr_un *)&sap;
+        sun->sun_family = AF_UNIX;
+        len = sizeof(sun->sun_path);
+        
+        if (strlen(path) >= len)
+            sod_bench_usage();
+        
+        (void)strncpy(sun->sun_path, path, len - 1);
+        
+        len += offsetof(struct sockaddr_un, sun_path);
+        
+        sod_bench_e2e(ntxn, conc);
+    } else {
+        sod_bench_prepare();
+        sod_bench_sendrecv();
+        sod_bench_pingpong(0);
+        sod_bench_pingpong(1);
+        sod_bench_conv(0);
+        sod_bench_conv(1);
+        sod_bench_audit();
+    }
+    exit(EX_OK);
+}
+
+/*
+ * By sod_cap.c used clock, because sod_sched.c is not linked.
+ */
+uint64_t
+sod_clock(void)
+{
+    struct timespec ts;
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+/*
+ * By sod_audit.c used symbols, because sod.c and 
+ * sod_sched.c are not linked.
+ */
+struct sod_class     sod_classes[SOD_CLASS_MAX];
+
+void
+sod_detach(void)
+{
+    
+}
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+static uint64_t
+sod_bench_clock(void)
+{
+    struct timespec ts;
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+static void
+sod_bench_prepare(void)
+{
+    struct sod_msg sm;
+    uint64_t t0;
+    long i;
+    
+    t0 = sod_bench_clock();
+    
+    for (i = 0; i < sod_bench_iter; i++) {
+        sod_msg_prepare(sod_bench_user, SOD_AUTH_REQ, &sm);
+        __asm__ __volatile__("" : : "r" (&sm) : "memory");
+    }
+    sod_bench_report("msg_prepare", NULL, sod_bench_iter, 
+        sod_bench_clock() - t0);
+}
+
+/*
+ * Both ends of socketpair(2) by the same thread, thus 
+ * the cost of the system calls without context switch.
+ */
+static void
+sod_bench_sendrecv(void)
+{
+    struct sod_msg sm;
+    uint64_t t0;
+    int sv[2];
+    long i;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err(EX_OSERR, "Can't create socketpair");
+    
+    sod_msg_prepare(sod_bench_user, SOD_AUTH_REQ, &sm);
+    
+    t0 = sod_bench_clock();
+    
+    for (i = 0; i < sod_bench_iter; i++) {
+        if (sod_msg_send(sv[0], &sm, 0) != sizeof(sm) 
+            || sod_msg_recv(sv[1], &sm, 0) != sizeof(sm))
+            errx(EX_SOFTWARE, "Can't exchange message");
+    }
+    sod_bench_report("msg_send_recv", "socket", sod_bench_iter, 
+        sod_bench_clock() - t0);
+    
+    (void)close(sv[0]);
+    (void)close(sv[1]);
+}
+
+/*
+ * Round trip with echoing thread.
+ */
+static void
+sod_bench_pingpong(int ring)
+{
+    struct sod_bench_thr bt;
+    struct sod_ring *rg = NULL;
+    struct sod_msg sm;
+    uint64_t t0;
+    int sv[2];
+    long i;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err(EX_OSERR, "Can't create socketpair");
+    
+    (void)memset(&bt, 0, sizeof(bt));
+    bt.bt_s = sv[1];
+    bt.bt_ntxn = ring;
+    
+    if (pthread_create(&bt.bt_tid, NULL, sod_bench_echo, &bt) != 0)
+        errx(EX_OSERR, "Can't create pthread(3)");
+    
+    if (ring != 0 && (rg = sod_ring_create(sv[0])) == NULL)
+        errx(EX_OSERR, "Can't establish ring");
+    
+    sod_msg_prepare(sod_bench_user, SOD_AUTH_REQ, &sm);
+    
+    t0 = sod_bench_clock();
+    
+    for (i = 0; i < sod_bench_iter; i++) {
+        if (rg != NULL) {
+            if (sod_ring_send(rg, &sm) != sizeof(sm) 
+                || sod_ring_recv(rg, &sm) != sizeof(sm))
+                errx(EX_SOFTWARE, "Can't exchange message");
+        } else if (sod_msg_send(sv[0], &sm, 0) != sizeof(sm) 
+            || sod_msg_recv(sv[0], &sm, MSG_WAITALL) != sizeof(sm))
+            errx(EX_SOFTWARE, "Can't exchange message");
+    }
+    sod_bench_report("msg_roundtrip", (ring != 0) ? "ring" : "socket", 
+        sod_bench_iter, sod_bench_clock() - t0);
+    
+    (void)close(sv[0]);
+    (void)pthread_join(bt.bt_tid, NULL);
+    
+    sod_ring_free(rg);
+}
+
+static void *
+sod_bench_echo(void *arg)
+{
+    struct sod_bench_thr *bt = arg;
+    struct sod_ring *rg = NULL;
+    struct sod_msg sm;
+    
+    if (bt->bt_ntxn != 0 && (rg = sod_ring_accept(bt->bt_s, &sm)) == NULL)
+        errx(EX_OSERR, "Can't accept ring");
+    
+    for (;;) {
+        if (rg != NULL) {
+            if (sod_ring_recv(rg, &sm) <= 0 || sod_ring_send(rg, &sm) < 0)
+                break;
+        } else if (sod_msg_recv(bt->bt_s, &sm, MSG_WAITALL) <= 0 
+            || sod_msg_send(bt->bt_s, &sm, 0) < 0)
+            break;
+    }
+    sod_ring_free(rg);
+    (void)close(bt->bt_s);
+    
+    return (NULL);
+}
+
+/*
+ * Conversation as performed during pam_authenticate(3), where 
+ * PAM_AUTHTOK is requested from an applicant thread.
+ */
+static void
+sod_bench_conv(int ring)
+{
+    struct sod_bench_thr bt;
+    struct sod_softc sc;
+    struct pam_message msg;
+    const struct pam_message *msgp = &msg;
+    struct pam_response *resp;
+    uint64_t t0;
+    int sv[2];
+    long i;
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err(EX_OSERR, "Can't create socketpair");
+    
+    (void)memset(&bt, 0, sizeof(bt));
+    bt.bt_s = sv[1];
+    bt.bt_ntxn = ring;
+    
+    if (pthread_create(&bt.bt_tid, NULL, sod_bench_applicant, &bt) != 0)
+        errx(EX_OSERR, "Can't create pthread(3)");
+    
+    (void)memset(&sc, 0, sizeof(sc));
+    sc.sc_rmt = sv[0];
+    
+    if (ring != 0 && (sc.sc_ring = sod_ring_accept(sv[0], &sc.sc_buf)) == NULL)
+        errx(EX_OSERR, "Can't accept ring");
+    
+    msg.msg_style = PAM_PROMPT_ECHO_OFF;
+    msg.msg = "Password:";
+    
+    t0 = sod_bench_clock();
+    
+    for (i = 0; i < sod_bench_iter; i++) {
+        resp = NULL;
+        
+        if (sod_conv(1, &msgp, &resp, &sc) != PAM_SUCCESS)
+            errx(EX_SOFTWARE, "Can't perform conversation");
+        
+        free(resp[0].resp);
+        free(resp);
+    }
+    sod_bench_report("conv", (ring != 0) ? "ring" : "socket", 
+        sod_bench_iter, sod_bench_clock() - t0);
+    
+    (void)close(sv[0]);
+    (void)pthread_join(bt.bt_tid, NULL);
+    
+    sod_ring_free(sc.sc_ring);
+}
+
+/*
+ * Push of audit records, in bursts the logger keeps up with.
+ */
+static void
+sod_bench_audit(void)
+{
+    struct sod_req sr;
+    uint64_t t0, ns = 0;
+    int i, r;
+    
+    if (sod_audit_open("bin:/dev/null") < 0 || sod_audit_start() < 0)
+        err(EX_OSERR, "Can't start audit");
+    
+    (void)memset(&sr, 0, sizeof(sr));
+    sr.sr_uid = getuid();
+    sr.sr_class = SOD_CLASS_AUTH;
+    
+    for (r = 0; r < SOD_BENCH_AUDIT_ROUNDS; r++) {
+        t0 = sod_bench_clock();
+        
+        for (i = 0; i < SOD_BENCH_AUDIT_BURST; i++) 
+            sod_audit_log(&sr, sod_bench_user, SOD_AUTH_ACK, 1);
+        
+        ns += sod_bench_clock() - t0;
+        
+        (void)usleep(SOD_BENCH_AUDIT_PAUSE);
+    }
+    sod_bench_report("audit_push", NULL, 
+        SOD_BENCH_AUDIT_BURST * SOD_BENCH_AUDIT_ROUNDS, ns);
+    
+    sod_audit_detach();
+}
+
+/*
+ * Answers any SOD_AUTH_NAK by PAM_AUTHTOK.
+ */
+static void *
+sod_bench_applicant(void *arg)
+{
+    struct sod_bench_thr *bt = arg;
+    struct sod_ring *rg = NULL;
+    struct sod_msg sm;
+    
+    if (bt->bt_ntxn != 0 && (rg = sod_ring_create(bt->bt_s)) == NULL)
+        errx(EX_OSERR, "Can't establish ring");
+    
+    for (;;) {
+        if (rg != NULL) {
+            if (sod_ring_recv(rg, &sm) <= 0)
+                break;
+        } else if (sod_msg_recv(bt->bt_s, &sm, MSG_WAITALL) <= 0)
+            break;
+        
+        sod_msg_prepare(sod_bench_pw, SOD_AUTH_REQ, &sm);
+        
+        if (rg != NULL) {
+            if (sod_ring_send(rg, &sm) < 0)
+                break;
+        } else if (sod_msg_send(bt->bt_s, &sm, 0) < 0)
+            break;
+    }
+    sod_ring_free(rg);
+    (void)close(bt->bt_s);
+    
+    return (NULL);
+}
+
+/*
+ * Transactions by concurrent applicants, each connects for any 
+ * transaction or, on -R, performs those during a ring session.
+ */
+static void
+sod_bench_e2e(long ntxn, int conc)
+{
+    struct sod_bench_thr *bt;
+    int64_t *lat, sum = 0;
+    long failed = 0, n = 0, i, j;
+    uint64_t t0, dt;
+    
+    if ((bt = calloc(conc, sizeof(*bt))) == NULL 
+        || (lat = calloc(ntxn, sizeof(*lat))) == NULL)
+        err(EX_OSERR, "Can't allocate");
+    
+    t0 = sod_bench_clock();
+    
+    for (i = 0; i < conc; i++) {
+        bt[i].bt_ntxn = ntxn / conc + ((i < ntxn % conc) ? 1 : 0);
+        bt[i].bt_lat = lat + n;
+        n += bt[i].bt_ntxn;
+        
+        if (pthread_create(&bt[i].bt_tid, NULL, sod_bench_client, 
+            &bt[i]) != 0)
+            errx(EX_OSERR, "Can't create pthread(3)");
+    }
+    
+    for (i = 0; i < conc; i++) {
+        (void)pthread_join(bt[i].bt_tid, NULL);
+        failed += bt[i].bt_failed;
+    }
+    dt = sod_bench_clock() - t0;
+/*
+ * Latencies of failed transactions are negative.
+ */    
+    for (i = j = 0; i < ntxn; i++) {
+        if (lat[i] >= 0) {
+            lat[j++] = lat[i];
+            sum += lat[i];
+        }
+    }
+    qsort(lat, j, sizeof(*lat), sod_bench_i64cmp);
+    
+    (void)printf("bench=e2e transport=%s transactions=%ld failed=%ld "
+        "concurrency=%d ns=%ju tps=%.1f\n", 
+        (sod_bench_ring != 0) ? "ring" : "socket", ntxn, failed, conc, 
+        (uintmax_t)dt, (double)ntxn * 1e9 / (double)dt);
+    
+    if (j > 0) {
+        (void)printf("bench=e2e_latency transport=%s lat_avg_us=%jd "
+            "lat_p50_us=%jd lat_p90_us=%jd lat_p99_us=%jd "
+            "lat_max_us=%jd\n", (sod_bench_ring != 0) ? "ring" : "socket", 
+            (intmax_t)(sum / j), (intmax_t)lat[j / 2], 
+            (intmax_t)lat[j * 90 / 100], (intmax_t)lat[j * 99 / 100], 
+            (intmax_t)lat[j - 1]);
+    }
+    free(lat);
+    free(bt);
+}
+
+static void *
+sod_bench_client(void *arg)
+{
+    struct sod_bench_thr *bt = arg;
+    struct sod_ring *rg = NULL;
+    uint64_t t0;
+    int s = -1;
+    long i;
+    
+    for (i = 0; i < bt->bt_ntxn; i++) {
+        t0 = sod_bench_clock();
+        
+        if (s < 0) {
+            if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+                err(EX_OSERR, "Can't create socket");
+            
+            if (connect(s, (struct sockaddr *)sun, len) < 0 
+                || (sod_bench_ring != 0 
+                && (rg = sod_ring_create(s)) == NULL)) {
+                (void)close(s);
+                s = -1;
+                goto bad;
+            }
+        }
+        
+        if (sod_bench_auth(s, rg) < 0) 
+            goto bad;
+        
+        if (rg == NULL) {
+            (void)close(s);
+            s = -1;
+        }
+        bt->bt_lat[i] = (int64_t)((sod_bench_clock() - t0) / 1000);
+        continue;
+bad:
+        bt->bt_failed += 1;
+        bt->bt_lat[i] = -1;
+/*
+ * Connection is closed by sod(8) after rejection.
+ */        
+        sod_ring_free(rg);
+        rg = NULL;
+        
+        if (s > -1)
+            (void)close(s);
+        
+        s = -1;
+    }
+    sod_ring_free(rg);
+    
+    if (s > -1)
+        (void)close(s);
+    
+    return (NULL);
+}
+
+/*
+ * Authenticate, as sod_test(1) does.
+ */
+static int
+sod_bench_auth(int s, struct sod_ring *rg)
+{
+    struct sod_msg sm;
+    const char *tok = sod_bench_user;
+    ssize_t n;
+    
+    for (;;) {
+        sod_msg_prepare(tok, SOD_AUTH_REQ, &sm);
+        
+        if (rg != NULL)
+            n = sod_ring_send(rg, &sm);
+        else 
+            n = sod_msg_send(s, &sm, 0);
+        
+        if (n != sizeof(sm))
+            return (-1);
+        
+        if (rg != NULL)
+            n = sod_ring_recv(rg, &sm);
+        else 
+            n = sod_msg_recv(s, &sm, MSG_WAITALL);
+        
+        if (n != sizeof(sm))
+            return (-1);
+        
+        switch (sm.sm_code) {
+        case SOD_AUTH_NAK:
+            tok = sod_bench_pw;
+            break;
+        case SOD_AUTH_ACK:
+            return (0);
+        default:
+            return (-1);
+        }
+    }
+}
+
+static void
+sod_bench_report(const char *name, const char *transport, long iter, 
+        uint64_t ns)
+{
+    
+    (void)printf("bench=%s", name);
+    
+    if (transport != NULL)
+        (void)printf(" transport=%s", transport);
+    
+    (void)printf(" iterations=%ld ns=%ju ns_per_op=%.1f\n", iter, 
+        (uintmax_t)ns, (double)ns / (double)iter);
+}
+
+static int
+sod_bench_i64cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    
+    return ((x > y) - (x < y));
+}
+
+static void
+sod_bench_usage(void)
+{
+    
+    (void)fprintf(stderr, "usage: sod_bench [-i iterations]\n"
+        "       sod_bench -e socket [-R] [-c concurrency] [-n transactions] "
+        "[-p pw] [-u user]\n");
+    exit(EX_USAGE);
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# Copyright 2016 Henning Matyschok.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+# version=0.3
+
+#
+# End-to-end benchmark. Starts sod(8), linked with fake pam(3), 
+# on a temporary socket and performs transactions by sod_bench, 
+# by socket and by ring session. If sod_launch is given, sod(8) 
+# is started twice by socket activation and exits when idle.
+#
+# usage: sod_e2e.sh sod sod_bench [transactions [concurrency [sod_launch]]]
+#
+
+SOD=$1
+BENCH=$2
+NTXN=${3:-1000}
+CONC=${4:-4}
+LAUNCH=$5
+
+if [ -z "$SOD" -o -z "$BENCH" ]; then
+	echo "usage: sod_e2e.sh sod sod_bench [transactions [concurrency" \
+	    "[sod_launch]]]" >&2
+	exit 64
+fi
+
+#
+# sod(8) refuses to run without privileges.
+#
+if [ "$(id -u)" -ne 0 ]; then
+	echo "bench=e2e skipped=not_root"
+	exit 0
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/sod_e2e.XXXXXX") || exit 71
+SOCK=$DIR/sod.sock
+PID=$DIR/sod.pid
+
+cleanup() {
+	[ -s "$PID" ] && kill "$(cat "$PID")" 2>/dev/null
+	[ -n "$LPID" ] && kill "$LPID" 2>/dev/null && wait "$LPID"
+	rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+"$SOD" -P "$PID" -S "$SOCK" -r "$CONC" || exit 71
+
+i=0
+while [ ! -S "$SOCK" -o ! -s "$PID" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "bench=e2e failed=startup"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+"$BENCH" -e "$SOCK" -n "$NTXN" -c "$CONC" || exit 1
+"$BENCH" -e "$SOCK" -R -n "$NTXN" -c "$CONC" || exit 1
+
+[ -z "$LAUNCH" ] && exit 0
+
+#
+# Socket activation, where the instance exits after 1s idle.
+#
+ASOCK=$DIR/sod_act.sock
+"$LAUNCH" "$ASOCK" "$SOD" -P "$DIR/sod_act.pid" -t 1 >"$DIR/launch.out" &
+LPID=$!
+
+i=0
+while [ ! -S "$ASOCK" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "bench=e2e_activation failed=startup"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+for round in 1 2; do
+	"$BENCH" -e "$ASOCK" -n "$NTXN" -c "$CONC" >/dev/null || exit 1
+	sleep 2
+done
+
+echo "bench=e2e_activation launches=$(grep -c '^launch=' "$DIR/launch.out")" \
+    "clean_exits=$(grep -c 'status=0$' "$DIR/launch.out")"
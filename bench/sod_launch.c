@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Minimal launcher for socket activation of sod(8), as 
+ * described by sd_listen_fds(3).
+ *
+ * The launcher binds and listens on socket. Whenever a connection 
+ * is pending and no instance is running, it executes command with 
+ * the listening socket as descriptor 3 and sets LISTEN_PID and 
+ * LISTEN_FDS accordingly. The launcher waits for termination of 
+ * the instance, e. g. by idle timeout, and listens again.
+ */
+
+#define SOD_LAUNCH_FD     3
+
+static volatile sig_atomic_t     sod_launch_done;
+static volatile pid_t     sod_launch_pid;
+
+static void     sod_launch_exec(int, char **);
+static void     sod_launch_term(int);
+static void     sod_launch_usage(void);
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_un sun;
+    struct pollfd pfd;
+    int s, status, n = 0;
+    pid_t pid;
+    
+    if (argc < 3)
+        sod_launch_usage();
+    
+    (void)memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    
+    if (strlen(argv[1]) >= sizeof(sun.sun_path))
+        sod_launch_usage();
+    
+    (void)memcpy(sun.sun_path, argv[1], strlen(argv[1]));
+    
+    if ((s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+        err(EX_OSERR, "Can't create socket");
+    
+    (void)unlink(sun.sun_path);
+    
+    if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+        err(EX_OSERR, "Can't bind %s", sun.sun_path);
+    
+    if (listen(s, SOMAXCONN) < 0)
+        err(EX_OSERR, "Can't listen %s", sun.sun_path);
+    
+    (void)signal(SIGINT, sod_launch_term);
+    (void)signal(SIGTERM, sod_launch_term);
+    
+    while (sod_launch_done == 0) {
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        if (poll(&pfd, 1, -1) < 0) 
+            continue;
+        
+        if ((pid = fork()) < 0) 
+            err(EX_OSERR, "Can't fork");
+        
+        if (pid == 0) 
+            sod_launch_exec(s, argv + 2);
+        
+        sod_launch_pid = pid;
+/*
+ * The instance detaches neither by fork(2) nor by setsid(2) 
+ * and exits, when idle. It refuses binary upgrade, thus no 
+ * instance survives its exit and listening again is safe.
+ */        
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            continue;
+        
+        sod_launch_pid = 0;
+        n += 1;
+        (void)printf("launch=%d pid=%d status=%d\n", n, (int)pid, 
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        (void)fflush(stdout);
+/*
+ * Avoid respawning a failing instance at full speed.
+ */        
+        if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != EX_OK)
+            (void)sleep(1);
+    }
+    (void)unlink(sun.sun_path);
+    
+    return (EX_OK);
+}
+
+static void
+sod_launch_exec(int s, char **argv)
+{
+    char buf[sizeof("2147483647")];
+    
+    if (s == SOD_LAUNCH_FD) {
+        if (fcntl(s, F_SETFD, 0) < 0)
+            err(EX_OSERR, "Can't clear FD_CLOEXEC");
+    } else if (dup2(s, SOD_LAUNCH_FD) < 0)
+        err(EX_OSERR, "Can't pass socket");
+    
+    (void)snprintf(buf, sizeof(buf), "%d", (int)getpid());
+    
+    if (setenv("LISTEN_PID", buf, 1) < 0 
+        || setenv("LISTEN_FDS", "1", 1) < 0)
+        err(EX_OSERR, "Can't set environment");
+    
+    (void)signal(SIGINT, SIG_DFL);
+    (void)signal(SIGTERM, SIG_DFL);
+    
+    (void)execvp(argv[0], argv);
+    err(EX_OSERR, "Can't execute %s", argv[0]);
+}
+
+/*
+ * Terminate running instance as well.
+ */
+static void
+sod_launch_term(int sig)
+{
+    
+    sod_launch_done = 1;
+    
+    if (sod_launch_pid > 0)
+        (void)kill(sod_launch_pid, sig);
+}
+
+static void
+sod_launch_usage(void)
+{
+    
+    (void)fprintf(stderr, "usage: sod_launch socket command ...\n");
+    exit(EX_USAGE);
+}
@@ -63,6 +63,16 @@ typedef ssize_t     (*sod_msg_fn_t)(int, struct sod_msg *, int);
 #define SOD_PASSWD_ACK     (SOD_PASSWD_REQ|SOD_MSG_ACK)
 #define SOD_PASSWD_REJ     (SOD_PASSWD_REQ|SOD_MSG_REJ)
 
+/*
+ * Handshake of transport by shared memory, see sod_ring_create(3).
+ */
+#define SOD_RING_REQ    0x00000004
+
+#define SOD_RING_ACK     (SOD_RING_REQ|SOD_MSG_ACK)
+#define SOD_RING_REJ     (SOD_RING_REQ|SOD_MSG_REJ)
+
+struct sod_ring;
+
 __BEGIN_DECLS
 struct sod_msg *     sod_msg_alloc(void);
 void     sod_msg_prepare(const char *, int, struct sod_msg *);
@@ -70,6 +80,12 @@ ssize_t     sod_msg_send(int, struct sod_msg *, int);
 ssize_t     sod_msg_recv(int, struct sod_msg *, int);
 ssize_t     sod_msg_fn(sod_msg_fn_t, int, struct sod_msg *);
 void     sod_msg_free(struct sod_msg *);
+struct sod_ring *     sod_ring_create(int);
+struct sod_ring *     sod_ring_accept(int, struct sod_msg *);
+ssize_t     sod_ring_send(struct sod_ring *, struct sod_msg *);
+ssize_t     sod_ring_recv(struct sod_ring *, struct sod_msg *);
+void     sod_ring_timo(struct sod_ring *, int);
+void     sod_ring_free(struct sod_ring *);
 __END_DECLS
 
 #endif /* _SOD_H_ */
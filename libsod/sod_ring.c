@@ -0,0 +1,453 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sod.h"
+
+/*
+ * Transport by shared memory.
+ *
+ * After handshake on its socket, messages are exchanged by a pair 
+ * of single producer, single consumer rings in shared memory. The 
+ * shared memory and an eventfd(2) per direction are created by the 
+ * applicant and passed by SCM_RIGHTS along with SOD_RING_REQ. A 
+ * consumer spins for a while and sleeps on its eventfd(2), if no 
+ * message is available. A producer writes its eventfd(2) only, if
+ * the consumer sleeps. Thus messages are exchanged without any 
+ * syscall, as long as both parties are busy. The socket remains 
+ * open, its EOF denotes termination of the session.
+ */
+
+#define SOD_RING_MAGIC     0x52444f53     /* "SODR" */
+#define SOD_RING_SLOTS     16     /* power of 2 */
+#define SOD_RING_SPIN     1024
+#define SOD_RING_NFD     3     /* shared memory, eventfd(2) pair */
+#define SOD_RING_EFD     "anon_inode:[eventfd]"
+
+struct sod_ring_q {
+    alignas(64) atomic_uint     rq_head;     /* by consumer */
+    atomic_uint     rq_sleeping;     /* by consumer */
+    alignas(64) atomic_uint     rq_tail;     /* by producer */
+    alignas(64) struct sod_msg     rq_slot[SOD_RING_SLOTS];
+};
+
+struct sod_ring_shm {
+    uint32_t     rs_magic;
+    struct sod_ring_q     rs_q[2];     /* to sod(8), to applicant */
+};
+
+struct sod_ring {
+    int     rg_s;     /* socket */
+    struct sod_ring_shm     *rg_shm;
+    struct sod_ring_q     *rg_tx;
+    struct sod_ring_q     *rg_rx;
+    int     rg_tx_efd;
+    int     rg_rx_efd;
+    int     rg_timo;     /* msec, receiver idle */
+};
+
+static int     sod_ring_wait(struct sod_ring *);
+static int     sod_ring_efd(int);
+
+/*
+ * By applicant performed handshake on connected socket.
+ */
+struct sod_ring * 
+sod_ring_create(int s)
+{
+    struct sod_ring_shm *rs = MAP_FAILED;
+    struct sod_ring *rg = NULL;
+    struct sod_msg sm;
+    struct msghdr mh;
+    struct cmsghdr *cmh;
+    struct iovec iov;
+    union {
+        struct cmsghdr     cm;
+        char     buf[CMSG_SPACE(SOD_RING_NFD * sizeof(int))];
+    } cbuf;
+    int fd[SOD_RING_NFD] = { -1, -1, -1 };
+    int i;
+    
+    if ((fd[0] = memfd_create("sod_ring", MFD_CLOEXEC|MFD_ALLOW_SEALING)) < 0)
+        goto bad;
+/*
+ * Prohibit truncation, because sod(8) maps the object.
+ */    
+    if (ftruncate(fd[0], sizeof(*rs)) < 0 
+        || fcntl(fd[0], F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_SEAL) < 0)
+        goto bad;
+    
+    if ((fd[1] = eventfd(0, EFD_CLOEXEC)) < 0 
+        || (fd[2] = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto bad;
+    
+    rs = mmap(NULL, sizeof(*rs), PROT_READ|PROT_WRITE, MAP_SHARED, 
+        fd[0], 0);
+    
+    if (rs == MAP_FAILED)
+        goto bad;
+    
+    rs->rs_magic = SOD_RING_MAGIC;
+    
+    if ((rg = calloc(1, sizeof(*rg))) == NULL)
+        goto bad;
+    
+    rg->rg_s = s;
+    rg->rg_shm = rs;
+    rg->rg_tx = &rs->rs_q[0];
+    rg->rg_rx = &rs->rs_q[1];
+    rg->rg_tx_efd = fd[1];
+    rg->rg_rx_efd = fd[2];
+    rg->rg_timo = INFTIM;
+/*
+ * Pass shared memory and eventfd(2) pair.
+ */    
+    sod_msg_prepare(NULL, SOD_RING_REQ, &sm);
+    
+    (void)memset(&cbuf, 0, sizeof(cbuf));
+    (void)memset(&mh, 0, sizeof(mh));
+    
+    iov.iov_base = &sm;
+    iov.iov_len = sizeof(sm);
+    
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    
+    cmh = CMSG_FIRSTHDR(&mh);
+    cmh->cmsg_level = SOL_SOCKET;
+    cmh->cmsg_type = SCM_RIGHTS;
+    cmh->cmsg_len = CMSG_LEN(sizeof(fd));
+    (void)memcpy(CMSG_DATA(cmh), fd, sizeof(fd));
+    
+    if (sendmsg(s, &mh, MSG_NOSIGNAL) != sizeof(sm))
+        goto bad;
+    
+    (void)close(fd[0]);
+    fd[0] = -1;
+/*
+ * Await acknowledgement.
+ */    
+    if (sod_msg_recv(s, &sm, MSG_WAITALL) != sizeof(sm) 
+        || sm.sm_code != SOD_RING_ACK) 
+        goto bad;
+    
+    return (rg);
+bad:
+    free(rg);
+    
+    if (rs != MAP_FAILED)
+        (void)munmap(rs, sizeof(*rs));
+    
+    for (i = 0; i < SOD_RING_NFD; i++) {
+        if (fd[i] > -1)
+            (void)close(fd[i]);
+    }
+    return (NULL);
+}
+
+/*
+ * By sod(8) performed handshake, where SOD_RING_REQ is 
+ * received. Any reply is sent by SOD_RING_ACK or SOD_RING_REJ.
+ */
+struct sod_ring * 
+sod_ring_accept(int s, struct sod_msg *sm)
+{
+    struct sod_ring_shm *rs = MAP_FAILED;
+    struct sod_ring *rg = NULL;
+    struct msghdr mh;
+    struct cmsghdr *cmh;
+    struct iovec iov;
+    struct stat st;
+    union {
+        struct cmsghdr     cm;
+        char     buf[CMSG_SPACE(SOD_RING_NFD * sizeof(int))];
+    } cbuf;
+    int fd[SOD_RING_NFD] = { -1, -1, -1 };
+    int i, seals;
+    
+    (void)memset(&cbuf, 0, sizeof(cbuf));
+    (void)memset(&mh, 0, sizeof(mh));
+    
+    iov.iov_base = sm;
+    iov.iov_len = sizeof(*sm);
+    
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    
+    if (recvmsg(s, &mh, MSG_WAITALL) != sizeof(*sm))
+        return (NULL);
+    
+    cmh = CMSG_FIRSTHDR(&mh);
+    
+    if (cmh != NULL && cmh->cmsg_level == SOL_SOCKET 
+        && cmh->cmsg_type == SCM_RIGHTS 
+        && cmh->cmsg_len == CMSG_LEN(sizeof(fd)))
+        (void)memcpy(fd, CMSG_DATA(cmh), sizeof(fd));
+    
+    if (sm->sm_code != SOD_RING_REQ || fd[0] < 0 
+        || (mh.msg_flags & MSG_CTRUNC) != 0)
+        goto bad;
+/*
+ * Anything else but eventfd(2) could block sod_ring_wait() 
+ * or the producer, e. g. a pipe never drained.
+ */    
+    if (sod_ring_efd(fd[1]) < 0 || sod_ring_efd(fd[2]) < 0)
+        goto bad;
+/*
+ * By applicant created object must not shrink.
+ */    
+    if (fstat(fd[0], &st) < 0 || st.st_size < (off_t)sizeof(*rs))
+        goto bad;
+    
+    if ((seals = fcntl(fd[0], F_GET_SEALS)) < 0 
+        || (seals & F_SEAL_SHRINK) == 0)
+        goto bad;
+    
+    rs = mmap(NULL, sizeof(*rs), PROT_READ|PROT_WRITE, MAP_SHARED, 
+        fd[0], 0);
+    
+    if (rs == MAP_FAILED || rs->rs_magic != SOD_RING_MAGIC)
+        goto bad;
+    
+    if ((rg = calloc(1, sizeof(*rg))) == NULL)
+        goto bad;
+    
+    rg->rg_s = s;
+    rg->rg_shm = rs;
+    rg->rg_tx = &rs->rs_q[1];
+    rg->rg_rx = &rs->rs_q[0];
+    rg->rg_tx_efd = fd[2];
+    rg->rg_rx_efd = fd[1];
+    rg->rg_timo = INFTIM;
+    
+    (void)close(fd[0]);
+    
+    sod_msg_prepare(NULL, SOD_RING_ACK, sm);
+    
+    if (sod_msg_send(s, sm, 0) != sizeof(*sm)) {
+        sod_ring_free(rg);
+        return (NULL);
+    }
+    return (rg);
+bad:
+    if (rs != MAP_FAILED)
+        (void)munmap(rs, sizeof(*rs));
+    
+    for (i = 0; i < SOD_RING_NFD; i++) {
+        if (fd[i] > -1)
+            (void)close(fd[i]);
+    }
+    sod_msg_prepare(NULL, SOD_RING_REJ, sm);
+    (void)sod_msg_send(s, sm, 0);
+    
+    return (NULL);
+}
+
+/*
+ * Enqueue message. Fails by EAGAIN, if ring is full.
+ */
+ssize_t
+sod_ring_send(struct sod_ring *rg, struct sod_msg *sm)
+{
+    struct sod_ring_q *rq = rg->rg_tx;
+    unsigned int head, tail;
+    uint64_t v = 1;
+    
+    tail = atomic_load_explicit(&rq->rq_tail, memory_order_relaxed);
+    head = atomic_load_explicit(&rq->rq_head, memory_order_acquire);
+    
+    if (tail - head >= SOD_RING_SLOTS) {
+        errno = EAGAIN;
+        return (-1);
+    }
+    (void)memcpy(&rq->rq_slot[tail & (SOD_RING_SLOTS - 1)], sm, 
+        sizeof(*sm));
+    
+    atomic_store_explicit(&rq->rq_tail, tail + 1, memory_order_release);
+/*
+ * Pairs with fence in sod_ring_recv(), thus either 
+ * the consumer observes the message or its sleep.
+ */    
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (atomic_load_explicit(&rq->rq_sleeping, memory_order_relaxed) != 0) {
+        if (write(rg->rg_tx_efd, &v, sizeof(v)) < 0)
+            return (-1);
+    }
+    return (sizeof(*sm));
+}
+
+/*
+ * Dequeue message. Returns 0, if the peer has terminated.
+ */
+ssize_t
+sod_ring_recv(struct sod_ring *rg, struct sod_msg *sm)
+{
+    struct sod_ring_q *rq = rg->rg_rx;
+    unsigned int head, tail;
+    int spin, rv;
+    
+    head = atomic_load_explicit(&rq->rq_head, memory_order_relaxed);
+    
+    for (spin = 0;;) {
+        tail = atomic_load_explicit(&rq->rq_tail, memory_order_acquire);
+        
+        if (tail != head) {
+            (void)memcpy(sm, &rq->rq_slot[head & (SOD_RING_SLOTS - 1)], 
+                sizeof(*sm));
+            sm->sm_tok[SOD_NMAX] = '\0';
+            
+            atomic_store_explicit(&rq->rq_head, head + 1, 
+                memory_order_release);
+            
+            return (sizeof(*sm));
+        }
+        
+        if (spin < SOD_RING_SPIN) {
+            spin++;
+            continue;
+        }
+/*
+ * Announce sleep and recheck, before sleeping.
+ */        
+        atomic_store_explicit(&rq->rq_sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        
+        tail = atomic_load_explicit(&rq->rq_tail, memory_order_acquire);
+        
+        rv = (tail != head) ? 1 : sod_ring_wait(rg);
+        
+        atomic_store_explicit(&rq->rq_sleeping, 0, memory_order_relaxed);
+        
+        if (rv <= 0)
+            return (rv);
+    }
+}
+
+/*
+ * Bound time, sod_ring_recv() waits for a message. 
+ */
+void
+sod_ring_timo(struct sod_ring *rg, int timo)
+{
+    
+    rg->rg_timo = (timo > 0) ? timo : INFTIM;
+}
+
+/*
+ * Release ressources, but not the socket.
+ */
+void
+sod_ring_free(struct sod_ring *rg)
+{
+    
+    if (rg != NULL) {
+        (void)munmap(rg->rg_shm, sizeof(*rg->rg_shm));
+        (void)close(rg->rg_tx_efd);
+        (void)close(rg->rg_rx_efd);
+        (void)memset(rg, 0, sizeof(*rg));
+        free(rg);
+    }
+}
+
+/*
+ * Sleep until notified, EOF on socket or timeout. 
+ */
+static int
+sod_ring_wait(struct sod_ring *rg)
+{
+    struct pollfd pfd[2];
+    uint64_t v;
+    int n;
+    
+    pfd[0].fd = rg->rg_rx_efd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = rg->rg_s;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    
+    if ((n = poll(pfd, 2, rg->rg_timo)) < 0) 
+        return ((errno == EINTR) ? 1 : -1);
+    
+    if (n == 0) {
+        errno = ETIMEDOUT;
+        return (-1);
+    }
+    
+    if (pfd[0].revents & POLLIN) {
+        (void)read(rg->rg_rx_efd, &v, sizeof(v));
+        return (1);
+    }
+/*
+ * Any input on socket terminates the session.
+ */    
+    if (pfd[1].revents != 0)
+        return (0);
+    
+    return (1);
+}
+
+/*
+ * Verify, if descriptor denotes an eventfd(2). Those are 
+ * anonymous inodes, thus identified by their link in procfs.
+ */
+static int
+sod_ring_efd(int fd)
+{
+    char path[32], buf[sizeof(SOD_RING_EFD)];
+    ssize_t n;
+    
+    (void)snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    
+    if ((n = readlink(path, buf, sizeof(buf))) != sizeof(buf) - 1 
+        || memcmp(buf, SOD_RING_EFD, (size_t)n) != 0) {
+        errno = EBADF;
+        return (-1);
+    }
+    return (0);
+}
@@ -0,0 +1,614 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#define PAM_SM_AUTH
+#define PAM_SM_PASSWORD
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+/*
+ * Client of sod(8) as pam(3) module - pam_sod(8).
+ *
+ * Authentication is performed by sessions by shared memory, see 
+ * sod_ring_create(3), where sod(8) performs transactions by the 
+ * same child until the session is closed. Sessions persist in a 
+ * per-process pool, shared by concurrent pam(3) handles, thus a 
+ * login costs neither connect(2) nor fork(2) by sod(8). A stale 
+ * session, e. g. after restart of sod(8), is replaced once by a 
+ * new session. Any conversation of sod(8) is passed to the 
+ * conversation routine of the application.
+ *
+ * Each session occupies a child of sod(8) and counts against its 
+ * budget of sessions, thus idle sessions are closed after a while 
+ * and when the last pam(3) handle, which authenticated by the pool, 
+ * is released by pam_end(3). Therefore processes forked per login 
+ * do not hold sessions beyond their handle. If no session is 
+ * acknowledged in time, the transaction is performed by a 
+ * connection of its own.
+ *
+ * Password changes are serialized by sod(8) on its socket, thus 
+ * those are performed by a connection of their own.
+ */
+
+#define PAM_SOD_SESSIONS_DFLT     4
+#define PAM_SOD_SESSIONS_MAX     64
+
+#define PAM_SOD_IDLE     30     /* sec, below SOD_RING_IDLE of sod(8) */
+#define PAM_SOD_ACK_TIMO     1     /* sec */
+
+#define PAM_SOD_HANDLE     "pam_sod_handle"
+
+#define PAM_SOD_SOCK_MAX     sizeof(((struct sockaddr_un *)0)->sun_path)
+
+struct pam_sod_args {
+    const char     *pa_sock;
+    int     pa_sessions;     /* by pool, at most */
+};
+
+struct pam_sod_sess {
+    TAILQ_ENTRY(pam_sod_sess)     ps_next;
+    int     ps_s;
+    struct sod_ring     *ps_rg;
+    time_t     ps_idle;     /* since, monotonic */
+    char     ps_sock[PAM_SOD_SOCK_MAX];
+};
+TAILQ_HEAD(pam_sod_sess_list, pam_sod_sess);
+
+static pthread_mutex_t     pam_sod_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     pam_sod_cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t     pam_sod_once = PTHREAD_ONCE_INIT;
+
+static struct pam_sod_sess_list     pam_sod_idle = 
+    TAILQ_HEAD_INITIALIZER(pam_sod_idle);
+static int     pam_sod_nsess;     /* idle and in use */
+static int     pam_sod_nhandles;     /* by pool served pam(3) handles */
+
+static void     pam_sod_args(struct pam_sod_args *, int, const char **);
+static int     pam_sod_connect(const char *);
+static time_t     pam_sod_clock(void);
+static struct pam_sod_sess *     pam_sod_get(const struct pam_sod_args *);
+static void     pam_sod_put(struct pam_sod_sess *, int);
+static void     pam_sod_close(struct pam_sod_sess *);
+static void     pam_sod_drain(void);
+static void     pam_sod_hold(pam_handle_t *);
+static void     pam_sod_release(pam_handle_t *, void *, int);
+static void     pam_sod_init(void);
+static void     pam_sod_prepare(void);
+static void     pam_sod_parent(void);
+static void     pam_sod_child(void);
+static void     pam_sod_fini(void) __attribute__((__destructor__));
+static int     pam_sod_auth(pam_handle_t *, struct pam_sod_sess *, 
+    const char *, int *);
+static int     pam_sod_txn(pam_handle_t *, const char *, const char *, int);
+static int     pam_sod_conv(pam_handle_t *, struct sod_msg *);
+
+PAM_EXTERN int
+pam_sm_authenticate(pam_handle_t *pamh, int flags __unused, 
+        int argc, const char **argv)
+{
+    struct pam_sod_args pa;
+    struct pam_sod_sess *ps;
+    const char *user;
+    int pam_err, stale, retry;
+    
+    pam_sod_args(&pa, argc, argv);
+    
+    if ((pam_err = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
+        return (pam_err);
+    
+    if (user == NULL || strlen(user) > SOD_NMAX)
+        return (PAM_USER_UNKNOWN);
+    
+    pam_sod_hold(pamh);
+    
+    for (retry = 0;; retry++) {
+        if ((ps = pam_sod_get(&pa)) == NULL)
+            return (pam_sod_txn(pamh, pa.pa_sock, user, SOD_AUTH_REQ));
+        
+        pam_err = pam_sod_auth(pamh, ps, user, &stale);
+/*
+ * Session remains usable, if the transaction was completed.
+ */        
+        pam_sod_put(ps, pam_err == PAM_SUCCESS || pam_err == PAM_AUTH_ERR);
+        
+        if (stale == 0 || retry > 0)
+            break;
+    }
+    return (pam_err);
+}
+
+PAM_EXTERN int
+pam_sm_setcred(pam_handle_t *pamh __unused, int flags __unused, 
+        int argc __unused, const char **argv __unused)
+{
+    
+    return (PAM_SUCCESS);
+}
+
+PAM_EXTERN int
+pam_sm_chauthtok(pam_handle_t *pamh, int flags, 
+        int argc, const char **argv)
+{
+    struct pam_sod_args pa;
+    const char *user;
+    int pam_err;
+    
+    if (flags & PAM_PRELIM_CHECK)
+        return (PAM_SUCCESS);
+    
+    pam_sod_args(&pa, argc, argv);
+    
+    if ((pam_err = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS)
+        return (pam_err);
+    
+    if (user == NULL || strlen(user) > SOD_NMAX)
+        return (PAM_USER_UNKNOWN);
+    
+    return (pam_sod_txn(pamh, pa.pa_sock, user, SOD_PASSWD_REQ));
+}
+
+/*
+ * Perform transaction by connection of its own.
+ */
+static int
+pam_sod_txn(pam_handle_t *pamh, const char *path, const char *user, 
+        int code)
+{
+    struct sod_msg sm;
+    int pam_err, s;
+    
+    if ((s = pam_sod_connect(path)) < 0)
+        return (PAM_AUTHINFO_UNAVAIL);
+    
+    sod_msg_prepare(user, code, &sm);
+    
+    for (pam_err = -1; pam_err < 0;) {
+        if (sod_msg_send(s, &sm, MSG_NOSIGNAL) != sizeof(sm) 
+            || sod_msg_recv(s, &sm, MSG_WAITALL) != sizeof(sm))
+            sm.sm_code = -1;
+        
+        if (sm.sm_code == SOD_AUTH_NAK) {
+            if (pam_sod_conv(pamh, &sm) != PAM_SUCCESS)
+                pam_err = PAM_CONV_ERR;
+        } else if (code == SOD_PASSWD_REQ) {
+            if (sm.sm_code == SOD_PASSWD_ACK)
+                pam_err = PAM_SUCCESS;
+            else
+                pam_err = PAM_AUTHTOK_ERR;
+        } else {
+            if (sm.sm_code == SOD_AUTH_ACK)
+                pam_err = PAM_SUCCESS;
+            else if (sm.sm_code == SOD_AUTH_REJ)
+                pam_err = PAM_AUTH_ERR;
+            else
+                pam_err = PAM_AUTHINFO_UNAVAIL;
+        }
+    }
+    (void)memset(&sm, 0, sizeof(sm));
+    (void)close(s);
+    
+    return (pam_err);
+}
+
+/*
+ * Perform transaction by session. Sets stale, if no response 
+ * was received, thus the transaction may be repeated.
+ */
+static int
+pam_sod_auth(pam_handle_t *pamh, struct pam_sod_sess *ps, 
+        const char *user, int *stale)
+{
+    struct sod_msg sm;
+    int pam_err;
+    
+    *stale = 1;
+    
+    sod_msg_prepare(user, SOD_AUTH_REQ, &sm);
+    
+    for (pam_err = -1; pam_err < 0;) {
+        if (sod_ring_send(ps->ps_rg, &sm) != sizeof(sm) 
+            || sod_ring_recv(ps->ps_rg, &sm) != sizeof(sm)) {
+            pam_err = PAM_AUTHINFO_UNAVAIL;
+            break;
+        }
+        *stale = 0;
+        
+        switch (sm.sm_code) {
+        case SOD_AUTH_NAK:
+            if (pam_sod_conv(pamh, &sm) != PAM_SUCCESS)
+                pam_err = PAM_CONV_ERR;
+            break;
+        case SOD_AUTH_ACK:
+            pam_err = PAM_SUCCESS;
+            break;
+        case SOD_AUTH_REJ:
+            pam_err = PAM_AUTH_ERR;
+            break;
+        default:
+            pam_err = PAM_AUTHINFO_UNAVAIL;
+            break;
+        }
+    }
+    (void)memset(&sm, 0, sizeof(sm));
+    
+    return (pam_err);
+}
+
+/*
+ * Pass by SOD_AUTH_NAK received prompt to conversation 
+ * routine of application, its response is prepared as 
+ * SOD_AUTH_REQ.
+ */
+static int
+pam_sod_conv(pam_handle_t *pamh, struct sod_msg *sm)
+{
+    const struct pam_conv *conv;
+    const struct pam_message *msgp;
+    struct pam_message msg;
+    struct pam_response *resp = NULL;
+    const void *item;
+    int pam_err;
+    
+    if ((pam_err = pam_get_item(pamh, PAM_CONV, &item)) != PAM_SUCCESS)
+        return (pam_err);
+    
+    if ((conv = item) == NULL || conv->conv == NULL)
+        return (PAM_CONV_ERR);
+    
+    msg.msg_style = PAM_PROMPT_ECHO_OFF;
+    msg.msg = sm->sm_tok;
+    msgp = &msg;
+    
+    pam_err = (*conv->conv)(1, &msgp, &resp, conv->appdata_ptr);
+    
+    if (pam_err == PAM_SUCCESS) {
+        if (resp != NULL && resp[0].resp != NULL 
+            && strlen(resp[0].resp) <= SOD_NMAX) 
+            sod_msg_prepare(resp[0].resp, SOD_AUTH_REQ, sm);
+        else
+            pam_err = PAM_CONV_ERR;
+    }
+    
+    if (resp != NULL) {
+        if (resp[0].resp != NULL) {
+            (void)memset(resp[0].resp, 0, strlen(resp[0].resp));
+            free(resp[0].resp);
+        }
+        free(resp);
+    }
+    return (pam_err);
+}
+
+/*
+ * Parse module options, see pam_sod(8).
+ */
+static void
+pam_sod_args(struct pam_sod_args *pa, int argc, const char **argv)
+{
+    char *ep;
+    long val;
+    int i;
+    
+    pa->pa_sock = SOD_SOCK_FILE;
+    pa->pa_sessions = PAM_SOD_SESSIONS_DFLT;
+    
+    for (i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "socket=", 7) == 0 
+            && strlen(argv[i] + 7) < PAM_SOD_SOCK_MAX) 
+            pa->pa_sock = argv[i] + 7;
+        else if (strncmp(argv[i], "sessions=", 9) == 0) {
+            val = strtol(argv[i] + 9, &ep, 10);
+            
+            if (argv[i][9] != '\0' && *ep == '\0' 
+                && val > 0 && val <= PAM_SOD_SESSIONS_MAX)
+                pa->pa_sessions = (int)val;
+            else
+                syslog(LOG_WARNING, "pam_sod: Invalid %s", argv[i]);
+        } else
+            syslog(LOG_WARNING, "pam_sod: Unknown option %s", argv[i]);
+    }
+}
+
+/*
+ * Connect with sod(8).
+ */
+static int
+pam_sod_connect(const char *path)
+{
+    struct sockaddr_un sun;
+    int s;
+    
+    (void)memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void)strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    
+    if ((s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+        return (-1);
+    
+    if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        (void)close(s);
+        return (-1);
+    }
+    return (s);
+}
+
+/*
+ * Take idle session from pool or establish new one, 
+ * unless the pool is exhausted. Then await release.
+ * Returns NULL, if no session was acknowledged.
+ */
+static struct pam_sod_sess *
+pam_sod_get(const struct pam_sod_args *pa)
+{
+    struct pam_sod_sess *ps;
+    struct timeval tv;
+    time_t now;
+    
+    (void)pthread_once(&pam_sod_once, pam_sod_init);
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+/*
+ * Close sessions idle for too long, those are least 
+ * recently used, thus at the tail. Otherwise sod(8) 
+ * would keep their children.
+ */    
+    now = pam_sod_clock();
+    
+    while ((ps = TAILQ_LAST(&pam_sod_idle, pam_sod_sess_list)) != NULL 
+        && now - ps->ps_idle >= PAM_SOD_IDLE) {
+        TAILQ_REMOVE(&pam_sod_idle, ps, ps_next);
+        pam_sod_nsess -= 1;
+        pam_sod_close(ps);
+    }
+    
+    for (;;) {
+        TAILQ_FOREACH(ps, &pam_sod_idle, ps_next) {
+            if (strcmp(ps->ps_sock, pa->pa_sock) == 0)
+                break;
+        }
+        
+        if (ps != NULL) {
+            TAILQ_REMOVE(&pam_sod_idle, ps, ps_next);
+            (void)pthread_mutex_unlock(&pam_sod_mtx);
+            return (ps);
+        }
+        
+        if (pam_sod_nsess < pa->pa_sessions) 
+            break;
+/*
+ * Replace idle session on other socket, if any.
+ */        
+        if ((ps = TAILQ_FIRST(&pam_sod_idle)) != NULL) {
+            TAILQ_REMOVE(&pam_sod_idle, ps, ps_next);
+            pam_sod_nsess -= 1;
+            pam_sod_close(ps);
+            break;
+        }
+        (void)pthread_cond_wait(&pam_sod_cv, &pam_sod_mtx);
+    }
+    pam_sod_nsess += 1;
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+/*
+ * Establish session. Its acknowledgement is awaited in 
+ * bounded time, because sod(8) queues sessions beyond 
+ * its budget.
+ */    
+    if ((ps = calloc(1, sizeof(*ps))) != NULL) {
+        (void)strncpy(ps->ps_sock, pa->pa_sock, sizeof(ps->ps_sock) - 1);
+        
+        if ((ps->ps_s = pam_sod_connect(pa->pa_sock)) > -1) {
+            tv.tv_sec = PAM_SOD_ACK_TIMO;
+            tv.tv_usec = 0;
+            
+            if (setsockopt(ps->ps_s, SOL_SOCKET, SO_RCVTIMEO, 
+                &tv, sizeof(tv)) == 0
+                && (ps->ps_rg = sod_ring_create(ps->ps_s)) != NULL) {
+                tv.tv_sec = 0;
+                
+                (void)setsockopt(ps->ps_s, SOL_SOCKET, SO_RCVTIMEO, 
+                    &tv, sizeof(tv));
+                
+                return (ps);
+            }
+            (void)close(ps->ps_s);
+        }
+        free(ps);
+    }
+    syslog(LOG_NOTICE, "pam_sod: Can't establish session on %s", 
+        pa->pa_sock);
+    
+    pam_sod_put(NULL, 0);
+    
+    return (NULL);
+}
+
+/*
+ * Return session to pool or release it.
+ */
+static void
+pam_sod_put(struct pam_sod_sess *ps, int keep)
+{
+    
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+    
+    if (ps != NULL && keep != 0) {
+        ps->ps_idle = pam_sod_clock();
+        TAILQ_INSERT_HEAD(&pam_sod_idle, ps, ps_next);
+    } else {
+        pam_sod_nsess -= 1;
+        
+        if (ps != NULL)
+            pam_sod_close(ps);
+    }
+    (void)pthread_cond_signal(&pam_sod_cv);
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+static void
+pam_sod_close(struct pam_sod_sess *ps)
+{
+    
+    sod_ring_free(ps->ps_rg);
+    (void)close(ps->ps_s);
+    free(ps);
+}
+
+static time_t
+pam_sod_clock(void)
+{
+    struct timespec ts;
+    
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (ts.tv_sec);
+}
+
+/*
+ * A forked child must not share sessions with its parent. Those 
+ * handlers can't be unregistered, thus the module is linked by 
+ * -z nodelete.
+ */
+static void
+pam_sod_init(void)
+{
+    
+    (void)pthread_atfork(pam_sod_prepare, pam_sod_parent, pam_sod_child);
+}
+
+static void
+pam_sod_prepare(void)
+{
+    
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+}
+
+static void
+pam_sod_parent(void)
+{
+    
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+/*
+ * Sessions in use by other threads of the parent are 
+ * not accessible by the child, thus forgotten.
+ */
+static void
+pam_sod_child(void)
+{
+    struct pam_sod_sess *ps;
+    
+    while ((ps = TAILQ_FIRST(&pam_sod_idle)) != NULL) {
+        TAILQ_REMOVE(&pam_sod_idle, ps, ps_next);
+        pam_sod_close(ps);
+    }
+    pam_sod_nsess = 0;
+    
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+/*
+ * Account pam(3) handle, thus the pool is drained, when 
+ * the last one is released by pam_end(3).
+ */
+static void
+pam_sod_hold(pam_handle_t *pamh)
+{
+    const void *data;
+    
+    if (pam_get_data(pamh, PAM_SOD_HANDLE, &data) == PAM_SUCCESS 
+        && data != NULL)
+        return;
+    
+    if (pam_set_data(pamh, PAM_SOD_HANDLE, &pam_sod_nhandles, 
+        pam_sod_release) != PAM_SUCCESS)
+        return;
+    
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+    pam_sod_nhandles += 1;
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+static void
+pam_sod_release(pam_handle_t *pamh __unused, void *data __unused, 
+        int error_status __unused)
+{
+    
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+    
+    if (pam_sod_nhandles > 0 && --pam_sod_nhandles == 0)
+        pam_sod_drain();
+    
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+/*
+ * Close idle sessions, called with pam_sod_mtx held.
+ */
+static void
+pam_sod_drain(void)
+{
+    struct pam_sod_sess *ps;
+    
+    while ((ps = TAILQ_FIRST(&pam_sod_idle)) != NULL) {
+        TAILQ_REMOVE(&pam_sod_idle, ps, ps_next);
+        pam_sod_nsess -= 1;
+        pam_sod_close(ps);
+    }
+}
+
+/*
+ * Release idle sessions on exit(3). Linked by -z nodelete, 
+ * the module is never unloaded by pam_end(3) or dlclose(3).
+ */
+static void
+pam_sod_fini(void)
+{
+    
+    (void)pthread_mutex_lock(&pam_sod_mtx);
+    pam_sod_drain();
+    (void)pthread_mutex_unlock(&pam_sod_mtx);
+}
+
+#ifdef PAM_MODULE_ENTRY
+PAM_MODULE_ENTRY("pam_sod");
+#endif
@@ -35,10 +35,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <login_cap.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,24 +50,66 @@
 
 #include <sod.h>
 
+#include "sod_rec.h"
+#include "sod_var.h"
+
 /*
  * Simple sign-on service on demand daemon - sod(8).
  */
 
-struct sod_softc {
-    struct sod_msg     sc_buf;     /* for transaction used buffer */
-    int     sc_rmt;     /* fd, socket, applicant */
-};
 #define SOD_DFLT_BACKOFF     3
 #define SOD_RETRIES_DFLT     10
 
 #define SOD_PROMPT_DFLT        "login: "
 #define SOD_DFLT_PW_PROMPT    "Password:"
 
+/*
+ * Commands, passed by signal handler to main loop.
+ */
+#define SOD_CMD_RELOAD     'h'
+#define SOD_CMD_UPGRADE     'u'
+#define SOD_CMD_REAP     'c'
+#define SOD_CMD_STATS     's'
+
+/*
+ * Entries of poll(2) set, preceding pending connections.
+ */
+#define SOD_PFD_LISTEN     0
+#define SOD_PFD_CMD     1
+#define SOD_PFD_STATUS     2
+#define SOD_PFD_FIXED     3
+
+/*
+ * Listening socket is not polled for a while, if accept(2) 
+ * failed by exhausted descriptors or memory.
+ */
+#define SOD_ACCEPT_PAUSE     100     /* msec */
+
+/*
+ * Denotes by predecessor inherited listening socket.
+ */
+#define SOD_LISTEN_FD_ENV     "SOD_LISTEN_FD"
+
+/*
+ * Denotes pipe, where the successor signals its readiness 
+ * to its predecessor. Otherwise, the upgrade is abandoned.
+ */
+#define SOD_STATUS_FD_ENV     "SOD_STATUS_FD"
+#define SOD_UPGRADE_TIMO     30     /* sec */
+
+/*
+ * Socket activation, see sd_listen_fds(3).
+ */
+#define SOD_LISTEN_PID_ENV     "LISTEN_PID"
+#define SOD_LISTEN_FDS_ENV     "LISTEN_FDS"
+#define SOD_LISTEN_FDNAMES_ENV     "LISTEN_FDNAMES"
+#define SOD_LISTEN_FDS_START     3
+
 static pid_t     pid;
 static pthread_t     tid;
 
-static char     pid_file[] = SOD_PID_FILE;
+static const char     *pid_file = SOD_PID_FILE;
+static const char     *sock_file = SOD_SOCK_FILE;
 
 static char pid_file_buf[PATH_MAX + 1];
 
@@ -78,56 +122,175 @@ static sigset_t     nsigset;
 static char     prompt_default[] = SOD_PROMPT_DFLT;
 static char     pw_prompt_default[] = SOD_DFLT_PW_PROMPT;
 
+struct sod_conf     sod_cf;
+
+static int     sod_conf_loaded;
+
+static char     **sod_argv;
+static int     sod_lfd = -1;
+static int     sod_pidfd = -1;
+static int     sod_cmd[2] = { -1, -1 };
+static int     sod_status = -1;     /* by successor, if upgrading */
+static uint64_t     sod_status_dl;
+static int     sod_ready = -1;     /* by predecessor, if successor */
+static int     sod_activated;
+static int     sod_early;     /* PAM_AUTHTOK requested in advance */
+static int     sod_successor;
+static int     sod_idle;
+static uint64_t     sod_last;
+static uint64_t     sod_paused;     /* accept(2) paused until */
+
+static volatile sig_atomic_t     sod_handoff;
+
 static void *    sod_sigaction(void *);
-static int     sod_conv(int, const struct pam_message **, 
-    struct pam_response **, void *);
-static void     sod_doit(int);
+static void     sod_conf_load(void);
+static int     sod_inherit(void);
+static int     sod_listening(int);
+static int     sod_upgrade(void);
+static void     sod_upgrade_done(int);
+static void     sod_command(void);
+static void     sod_cleanup(void);
+static ssize_t     sod_txn(struct sod_softc *);
+static int     sod_optnum(const char *, int);
+static void     sod_usage(void);
 
 /*
  * Fork.
  */
 int
-main(int argc __unused, char **argv __unused)
+main(int argc, char **argv)
 {
-    int fd;
+    const char *cap_file = NULL, *audit = NULL;
+    struct pollfd *pfd;
+    size_t nfds;
+    uint64_t now, warned = 0;
+    int fd, flags, ch, n, timo, nshards = 0;
+    
+    sod_argv = argv;
+    
+    while ((ch = getopt(argc, argv, "A:P:S:a:b:c:en:p:r:t:u:")) != -1) {
+        switch (ch) {
+        case 'A':
+            audit = optarg;
+            break;
+        case 'P':
+            pid_file = optarg;
+            break;
+        case 'S':
+            if (strlen(optarg) >= sizeof(sun->sun_path))
+                sod_usage();
+            
+            sock_file = optarg;
+            break;
+        case 'a':
+            sod_classes[SOD_CLASS_AUTH].sk_max = 
+                sod_optnum(optarg, INT_MAX);
+            break;
+        case 'b':
+            sod_backlog_max = sod_optnum(optarg, INT_MAX);
+            break;
+        case 'c':
+            cap_file = optarg;
+            break;
+        case 'e':
+            sod_early = 1;
+            break;
+        case 'n':
+            nshards = sod_optnum(optarg, SOD_SHARD_MAX);
+            break;
+        case 'p':
+            sod_classes[SOD_CLASS_PASSWD].sk_max = 
+                sod_optnum(optarg, INT_MAX);
+            break;
+        case 'r':
+            sod_classes[SOD_CLASS_RING].sk_max = 
+                sod_optnum(optarg, INT_MAX);
+            break;
+        case 't':
+            sod_idle = sod_optnum(optarg, INT_MAX / 1000);
+            break;
+        case 'u':
+            if (sod_sched_peer(optarg) < 0)
+                sod_usage();
+            break;
+        default:
+            sod_usage();
+            break;
+        }
+    }
+    
+    if (argc != optind)
+        sod_usage();
     
     if (getuid() != 0) {
         syslog(LOG_ERR, "%s", strerror(EPERM));
         exit(EX_NOPERM);
     }
-    
-    if ((fd = open(pid_file, O_RDWR, 0640)) > -1) {
-        syslog(LOG_ERR, "Daemon already running");
-        exit(EX_OSFILE);
+/*
+ * Adopt listening socket, if passed by predecessor during 
+ * binary upgrade or by socket activation. The pid file is 
+ * stale, unless its lock is still held by some instance. 
+ */    
+    if (sod_inherit() < 0) {
+        if ((fd = open(pid_file, O_RDWR, 0640)) > -1) {
+            if (lockf(fd, F_TEST, 0) < 0) {
+                syslog(LOG_ERR, "Daemon already running");
+                exit(EX_OSFILE);
+            }
+            (void)close(fd);
+        }
     }
 /*
  * Disable hang-up signal.
  */
-    if (signal(SIGHUP, SIG_IGN) < 0) {
+    if (signal(SIGHUP, SIG_IGN) == SIG_ERR) {
         syslog(LOG_ERR, "Can't disable SIGHUP");
         exit(EX_OSERR);
     }
 /*
- * Avoid creation of zombie processes.
+ * Children are reaped by main loop, see sod_sched_reap(). 
+ * An ignored SIGCHLD would not be delivered by sigwait(2).
  */
-    if (signal(SIGCHLD, SIG_IGN) < 0) {
-        syslog(LOG_ERR, "Can't disable SIGCHILD");
+    if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+        syslog(LOG_ERR, "Can't reset SIGCHILD");
         exit(EX_OSERR);
     }
     
-    if ((pid = fork()) < 0) {
-        syslog(LOG_ERR, "Can't fork");
+/*
+ * Path of capture file may be relative.
+ */
+    if (cap_file != NULL && sod_cap_open(cap_file) < 0) {
+        syslog(LOG_ERR, "Can't open %s", cap_file);
+        exit(EX_CANTCREAT);
+    }
+    
+    if (audit != NULL && sod_audit_open(audit) < 0) {
+        syslog(LOG_ERR, "Can't open audit %s", audit);
+        exit(EX_CANTCREAT);
+    }
+
+    if (sod_flight_init() < 0) {
+        syslog(LOG_ERR, "Can't map flight table");
         exit(EX_OSERR);
     }
+/*
+ * If activated, the launcher supervises this process.
+ */    
+    if (sod_activated == 0) {
+        if ((pid = fork()) < 0) {
+            syslog(LOG_ERR, "Can't fork");
+            exit(EX_OSERR);
+        }
   
-    if (pid != 0) 
-        exit(EX_OK);
+        if (pid != 0) 
+            exit(EX_OK);
+    }
 /*
  * Daemonize.
  */  
     (void)umask(0);
 
-    if (setsid() < 0) {
+    if (sod_activated == 0 && setsid() < 0) {
         syslog(LOG_ERR, "Can't set session identifier");
         exit(EX_OSERR);
     }
@@ -139,6 +302,21 @@ main(int argc __unused, char **argv __unused)
     (void)close(STDIN_FILENO);
     (void)close(STDOUT_FILENO);
     (void)close(STDERR_FILENO);
+/*
+ * Keep descriptors of standard streams occupied, thus 
+ * sockets cannot collide with them after execve(2).
+ */
+    if ((fd = open("/dev/null", O_RDWR)) == STDIN_FILENO) {
+        (void)dup2(fd, STDOUT_FILENO);
+        (void)dup2(fd, STDERR_FILENO);
+    }
+/*
+ * Channel between signal handler and main loop.
+ */
+    if (pipe2(sod_cmd, O_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "Can't create command channel");
+        exit(EX_OSERR);
+    }
 /* 
  * Modefy signal handling and externalize.
  */
@@ -151,32 +329,51 @@ main(int argc __unused, char **argv __unused)
         syslog(LOG_ERR, "Can't apply modefied signal set");    
         exit(EX_OSERR);
     }
+/*
+ * Blocked SIGHUP remains deliverable by sigwait(2) 
+ * only, if its disposition is not SIG_IGN.
+ */    
+    (void)signal(SIGHUP, SIG_DFL);
+/*
+ * Logger inherits blocked signals, thus it 
+ * terminates by exit of this process only.
+ */    
+    if (sod_audit_start() < 0) {
+        syslog(LOG_ERR, "Can't start audit logger");
+        exit(EX_OSERR);
+    }
     
     if (pthread_create(&tid, NULL, sod_sigaction, NULL) != 0) {
         syslog(LOG_ERR, "Can't initialize signal handler");
         exit(EX_OSERR);   
     }
 /*
- * Create lockfile.
+ * Create lockfile. Its lock is held during lifetime, thus 
+ * a stale pid file does not prevent startup. The successor 
+ * of a binary upgrade waits until its predecessor has 
+ * released the lock, but not longer than its predecessor 
+ * awaits readiness.
  */        
-    if ((fd = open(pid_file, O_RDWR|O_CREAT, 0640)) < 0) {
+    if ((sod_pidfd = open(pid_file, O_RDWR|O_CREAT|O_CLOEXEC, 0640)) < 0) {
         syslog(LOG_ERR, "Can't open %s", pid_file);
         exit(EX_OSERR);
     }
     
-    if (lockf(fd, F_TLOCK, 0) < 0) {
-        syslog(LOG_ERR, "Can't lock %s", pid_file);
-        exit(EX_OSERR);
+    for (n = 0; lockf(sod_pidfd, F_TLOCK, 0) < 0; n++) {
+        if (sod_successor == 0 || n >= SOD_UPGRADE_TIMO * 10) {
+            syslog(LOG_ERR, "Can't lock %s", pid_file);
+            exit(EX_OSERR);
+        }
+        (void)usleep(100000);
     }
 
     (void)snprintf(pid_file_buf, PATH_MAX, "%d\n", getpid());
 
-    if (write(fd, pid_file_buf, PATH_MAX) < 0) {
+    if (ftruncate(sod_pidfd, 0) < 0 
+        || write(sod_pidfd, pid_file_buf, strlen(pid_file_buf)) < 0) {
         syslog(LOG_ERR, "Can't write %d in %s", getpid(), pid_file);
         exit(EX_OSERR);   
     }
-       
-    (void)close(fd);    
 /*
  * Create listening socket.
  */                
@@ -186,99 +383,614 @@ main(int argc __unused, char **argv __unused)
     sun->sun_family = AF_UNIX;
     len = sizeof(sun->sun_path);
 
-    (void)strncpy(sun->sun_path, SOD_SOCK_FILE, len - 1);
+    (void)strncpy(sun->sun_path, sock_file, len - 1);
 
     len += offsetof(struct sockaddr_un, sun_path);
     
-    if ((fd = socket(sun->sun_family, SOCK_STREAM, 0)) < 0) {
-        syslog(LOG_ERR, "Can't create socket");
-        exit(EX_OSERR);   
-    }
+    if (sod_lfd < 0) {
+        if ((sod_lfd = socket(sun->sun_family, SOCK_STREAM, 0)) < 0) {
+            syslog(LOG_ERR, "Can't create socket");
+            exit(EX_OSERR);   
+        }
     
-    (void)unlink(sun->sun_path);
+        (void)unlink(sun->sun_path);
 
-    if (bind(fd, (struct sockaddr *)sun, len) < 0) {
-        syslog(LOG_ERR, "Can't bind %s", sun->sun_path);    
-        exit(EX_OSERR);   
-    }
+        if (bind(sod_lfd, (struct sockaddr *)sun, len) < 0) {
+            syslog(LOG_ERR, "Can't bind %s", sun->sun_path);    
+            exit(EX_OSERR);   
+        }
         
-    if (listen(fd, SOD_MSG_QLEN) < 0) { 
-        syslog(LOG_ERR, "Can't listen %s", sun->sun_path);
+        if (listen(sod_lfd, SOD_MSG_QLEN) < 0) { 
+            syslog(LOG_ERR, "Can't listen %s", sun->sun_path);
+            exit(EX_OSERR);
+        }
+    }
+/*
+ * During binary upgrade, predecessor and successor may 
+ * accept(2) concurrently on the same socket. Thus accept(2) 
+ * must not block, after poll(2) has reported readiness.
+ */    
+    if ((flags = fcntl(sod_lfd, F_GETFL)) < 0 
+        || fcntl(sod_lfd, F_SETFL, flags|O_NONBLOCK) < 0) {
+        syslog(LOG_ERR, "Can't set O_NONBLOCK on %s", sun->sun_path);
         exit(EX_OSERR);
     }
 
+    sod_sched_init();
+    
+    if (nshards > 0 && sod_shard_init(nshards) < 0) {
+        syslog(LOG_ERR, "Can't initialize shards");
+        exit(EX_OSERR);
+    }
+    sod_last = sod_clock();
+/*
+ * Signal readiness to predecessor, which stops accepting 
+ * connections. If it has abandoned the upgrade, exit.
+ */    
+    if (sod_ready > -1) {
+        if (write(sod_ready, "", 1) != 1) {
+            syslog(LOG_ERR, "Can't signal readiness to predecessor");
+            exit(EX_OSERR);
+        }
+        (void)close(sod_ready);
+        sod_ready = -1;
+    }
+
     for (;;) {
         int rmt;
 /*
- * Wait until accept(2).
+ * Exit, if successor has taken over the listening socket 
+ * and in-flight transactions are drained.
+ */        
+        if (sod_handoff != 0 && sod_sched_busy() == 0)
+            break;
+        
+        if ((pfd = sod_sched_pollset(SOD_PFD_FIXED, &nfds)) == NULL) {
+            syslog(LOG_ERR, "Can't allocate poll set");
+            exit(EX_OSERR);
+        }
+        timo = sod_sched_timo(sod_idle);
+        
+        if (sod_paused != 0) {
+            now = sod_clock();
+            
+            if (now >= sod_paused)
+                sod_paused = 0;
+            else if (timo == INFTIM || 
+                (uint64_t)timo * 1000 > sod_paused - now) 
+                timo = (int)((sod_paused - now + 999) / 1000);
+        }
+        
+        if (sod_status > -1) {
+            now = sod_clock();
+            
+            if (now >= sod_status_dl)
+                timo = 0;
+            else if (timo == INFTIM || 
+                (uint64_t)timo * 1000 > sod_status_dl - now) 
+                timo = (int)((sod_status_dl - now + 999) / 1000);
+        }
+        pfd[SOD_PFD_LISTEN].fd = (sod_handoff == 0 && sod_paused == 0) ? 
+            sod_lfd : -1;
+        pfd[SOD_PFD_LISTEN].events = POLLIN;
+        pfd[SOD_PFD_LISTEN].revents = 0;
+        pfd[SOD_PFD_CMD].fd = sod_cmd[0];
+        pfd[SOD_PFD_CMD].events = POLLIN;
+        pfd[SOD_PFD_CMD].revents = 0;
+        pfd[SOD_PFD_STATUS].fd = sod_status;
+        pfd[SOD_PFD_STATUS].events = POLLIN;
+        pfd[SOD_PFD_STATUS].revents = 0;
+/*
+ * Wait until accept(2), input or command.
  */
-        if ((rmt = accept(fd, NULL, NULL)) < 0)
-            continue;        
-
-        if (fork() == 0) {
+        if ((n = poll(pfd, nfds, timo)) < 0)
+            continue;
 /*
- * Prohibit access by child on file descriptor
- * denotes server socket(9) on unix(4) domain. 
- */       
-            (void)close(fd);
+ * Exit, if idle timeout has expired without transaction 
+ * in progress. On activation, the launcher listens again.
+ */        
+        if (n == 0 && sod_idle > 0 && sod_handoff == 0 
+            && sod_status < 0 && sod_sched_busy() == 0 
+            && sod_clock() - sod_last >= (uint64_t)sod_idle * 1000000) {
+            syslog(LOG_INFO, "Idle timeout expired");
+            sod_cleanup();
+            exit(EX_OK);
+        }
+        
+        if (pfd[SOD_PFD_CMD].revents & POLLIN) 
+            sod_command();
+        
+        if (sod_status > -1 && (pfd[SOD_PFD_STATUS].revents != 0 
+            || sod_clock() >= sod_status_dl))
+            sod_upgrade_done(pfd[SOD_PFD_STATUS].revents != 0);
+        
+        if (sod_handoff == 0 
+            && (pfd[SOD_PFD_LISTEN].revents & POLLIN) != 0
+            && (rmt = accept4(sod_lfd, NULL, NULL, SOCK_CLOEXEC)) > -1) {
+            sod_last = sod_clock();
 /*
- * Perform pam(8) transaction.
+ * Accepted socket may inherit O_NONBLOCK, but 
+ * transaction is performed by blocking I/O. It is 
+ * not inherited by a successor by binary upgrade.
  */
-            sod_doit(rmt);
-            exit(EX_OK);
-        }    
+            if ((flags = fcntl(rmt, F_GETFL)) < 0 
+                || fcntl(rmt, F_SETFL, flags & ~O_NONBLOCK) < 0
+                || sod_sched_enter(rmt) < 0) 
+                (void)close(rmt);
+/*
+ * Deferred until first transaction, thus startup by 
+ * activation is not delayed by parsing login.conf(5).
+ */        
+            if (sod_conf_loaded == 0)
+                sod_conf_load();
+        } else if (sod_handoff == 0 
+            && (pfd[SOD_PFD_LISTEN].revents & POLLIN) != 0
+            && (errno == EMFILE || errno == ENFILE 
+            || errno == ENOBUFS || errno == ENOMEM)) {
 /*
- * Parent does not need an open file descriptor 
- * denotes accepted connection, because child
- * performs pam(8) transaction on iherited once.
- */     
-        (void)close(rmt);
+ * The listening socket remains readable, thus it is 
+ * not polled, until descriptors might be released.
+ */            
+            now = sod_clock();
+            
+            if (warned == 0 || now - warned >= 60 * 1000000) {
+                syslog(LOG_WARNING, "Can't accept, because of %s", 
+                    strerror(errno));
+                warned = now;
+            }
+            sod_paused = now + SOD_ACCEPT_PAUSE * 1000;
+        }
+/*
+ * Classify pending connections and dispatch.
+ */        
+        sod_sched_input(pfd + SOD_PFD_FIXED, nfds - SOD_PFD_FIXED);
+        sod_sched_dispatch();
     }
+    exit(EX_OK);
             /* NOT REACHED */    
 }
 
 /*
- * By child performed pam(8) transaction.
+ * Perform by signal handler passed commands.
  */
-static void     
-sod_doit(int r)
+static void
+sod_command(void)
+{
+    char cmd[16];
+    ssize_t i, n;
+    
+    if ((n = read(sod_cmd[0], cmd, sizeof(cmd))) < 0)
+        return;
+    
+    for (i = 0; i < n; i++) {
+        switch (cmd[i]) {
+        case SOD_CMD_RELOAD:
+            if (sod_conf_loaded != 0)
+                sod_conf_load();
+            
+            sod_audit_reopen();
+            syslog(LOG_INFO, "Reloaded configuration");
+            break;
+        case SOD_CMD_UPGRADE:
+            if (sod_handoff == 0 && sod_status < 0)
+                (void)sod_upgrade();
+            break;
+        case SOD_CMD_REAP:
+            sod_sched_reap();
+            break;
+        case SOD_CMD_STATS:
+            sod_sched_stats();
+            sod_audit_stats();
+            sod_flight_stats();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * Prohibit access by child on file descriptors denoting 
+ * server socket(9) on unix(4) domain and those of parent.
+ */
+void
+sod_detach(void)
+{
+    
+    if (sod_lfd > -1)
+        (void)close(sod_lfd);
+    
+    (void)close(sod_cmd[0]);
+    (void)close(sod_cmd[1]);
+    
+    if (sod_pidfd > -1)
+        (void)close(sod_pidfd);
+    
+    if (sod_status > -1)
+        (void)close(sod_status);
+    
+    if (sod_ready > -1)
+        (void)close(sod_ready);
+    
+    sod_audit_detach();
+    
+    sod_lfd = sod_cmd[0] = sod_cmd[1] = sod_pidfd = -1;
+    sod_status = sod_ready = -1;
+}
+
+/*
+ * Cache by login.conf(5) specified attributes, parts 
+ * of in login.c defined codesections are reused here.
+ */
+static void
+sod_conf_load(void)
+{
+    login_cap_t *lc;
+    
+    (void)memset(&sod_cf, 0, sizeof(sod_cf));
+    
+    lc = login_getclass(NULL);
+    (void)strncpy(sod_cf.sf_prompt, login_getcapstr(lc, "login_prompt", 
+        prompt_default, prompt_default), SOD_NMAX);
+    (void)strncpy(sod_cf.sf_pw_prompt, login_getcapstr(lc, "passwd_prompt", 
+        pw_prompt_default, pw_prompt_default), SOD_NMAX);
+    sod_cf.sf_retries = login_getcapnum(lc, "login-retries", 
+        SOD_RETRIES_DFLT, SOD_RETRIES_DFLT);
+    sod_cf.sf_backoff = login_getcapnum(lc, "login-backoff", 
+        SOD_DFLT_BACKOFF, SOD_DFLT_BACKOFF);
+    login_close(lc);
+    
+    sod_conf_loaded = 1;
+}
+
+
+/*
+ * Remove socket and pid file, unless owned by successor 
+ * or, in case of socket activation, by the launcher.
+ */
+static void
+sod_cleanup(void)
+{
+    
+    if (sod_handoff != 0)
+        return;
+    
+    if (sod_activated == 0 && sun != NULL)
+        (void)unlink(sun->sun_path);
+        
+    (void)unlink(pid_file);
+}
+
+/*
+ * Parse numerical argument of option.
+ */
+static int
+sod_optnum(const char *s, int max)
+{
+    char *ep;
+    long val;
+    
+    val = strtol(s, &ep, 10);
+            
+    if (*s == '\0' || *ep != '\0' || val < 0 || val > max)
+        sod_usage();
+    
+    return ((int)val);
+}
+
+static void
+sod_usage(void)
+{
+    
+    (void)fprintf(stderr, "usage: sod [-A audit] [-P pid_file] [-S socket] "
+        "[-a auth_max]\n"
+        "           [-b backlog] [-c capture] [-e] [-n shards] "
+        "[-p passwd_max]\n"
+        "           [-r ring_max] [-t idle] [-u user[:weight[:max]]] ...\n");
+    exit(EX_USAGE);
+}
+
+/*
+ * Adopt by predecessor or by launcher passed listening 
+ * socket, if any. Anything else is refused.
+ */
+static int 
+sod_inherit(void)
+{
+    const char *s;
+    char *ep;
+    long fd, st;
+    
+    if ((s = getenv(SOD_LISTEN_PID_ENV)) != NULL) {
+        fd = strtol(s, &ep, 10);
+        
+        if (*s == '\0' || *ep != '\0' || fd != (long)getpid())
+            return (-1);
+        
+        if ((s = getenv(SOD_LISTEN_FDS_ENV)) == NULL)
+            return (-1);
+        
+        fd = strtol(s, &ep, 10);
+        
+        (void)unsetenv(SOD_LISTEN_PID_ENV);
+        (void)unsetenv(SOD_LISTEN_FDS_ENV);
+        (void)unsetenv(SOD_LISTEN_FDNAMES_ENV);
+        
+        if (*s == '\0' || *ep != '\0' || fd != 1 
+            || sod_listening(SOD_LISTEN_FDS_START) < 0) {
+            syslog(LOG_ERR, "Can't adopt %s passed sockets, exactly one "
+                "listening socket on unix(4) domain is served", s);
+            exit(EX_CONFIG);
+        }
+        sod_lfd = SOD_LISTEN_FDS_START;
+        sod_activated = 1;
+        
+        return (0);
+    }
+    
+    if ((s = getenv(SOD_LISTEN_FD_ENV)) == NULL)
+        return (-1);
+    
+    fd = strtol(s, &ep, 10);
+    
+    (void)unsetenv(SOD_LISTEN_FD_ENV);
+    
+    if (*s == '\0' || *ep != '\0' || fd < 0 || fd > INT_MAX 
+        || sod_listening((int)fd) < 0) {
+        syslog(LOG_ERR, "Can't adopt socket %s of predecessor", s);
+        exit(EX_CONFIG);
+    }
+    sod_successor = 1;
+    
+    if ((s = getenv(SOD_STATUS_FD_ENV)) != NULL) {
+        st = strtol(s, &ep, 10);
+        
+        if (*s != '\0' && *ep == '\0' && st > STDERR_FILENO 
+            && st <= INT_MAX && fcntl((int)st, F_SETFD, FD_CLOEXEC) == 0)
+            sod_ready = (int)st;
+        
+        (void)unsetenv(SOD_STATUS_FD_ENV);
+    }
+/*
+ * Move out of range of standard streams, 
+ * because those are closed by daemonizing.
+ */    
+    if (fd <= STDERR_FILENO) {
+        if ((sod_lfd = fcntl((int)fd, F_DUPFD, STDERR_FILENO + 1)) < 0)
+            return (-1);
+        
+        (void)close((int)fd);
+    } else
+        sod_lfd = (int)fd;
+    
+    return (0);
+}
+
+/*
+ * Verify, if inherited descriptor denotes a listening 
+ * stream socket on unix(4) domain.
+ */
+static int
+sod_listening(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t slen;
+    int val;
+    
+    slen = sizeof(val);
+    
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &slen) < 0 
+        || val == 0)
+        return (-1);
+    
+    slen = sizeof(val);
+    
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &slen) < 0 
+        || val != SOCK_STREAM)
+        return (-1);
+    
+    slen = sizeof(ss);
+    
+    if (getsockname(fd, (struct sockaddr *)&ss, &slen) < 0 
+        || ss.ss_family != AF_UNIX)
+        return (-1);
+    
+    return (0);
+}
+
+/*
+ * Binary upgrade. Execute successor with inherited listening 
+ * socket. Connections are accepted until the successor signals 
+ * its readiness, see sod_upgrade_done(). Returns 0, if forked.
+ */
+static int 
+sod_upgrade(void)
+{
+    sigset_t oset;
+    char buf[sizeof("2147483647")];
+    char sbuf[sizeof("2147483647")];
+    int st[2];
+    pid_t cpid;
+    
+    if (sod_argv == NULL || sod_argv[0] == NULL || sod_argv[0][0] != '/') {
+        syslog(LOG_ERR, "Can't upgrade, because not started by "
+            "absolute pathname");
+        return (-1);
+    }
+/*
+ * The launcher supervises this process, thus it would 
+ * regard its exit as termination of the service.
+ */    
+    if (sod_activated != 0) {
+        syslog(LOG_ERR, "Can't upgrade, because activated by launcher, "
+            "restart by launcher instead");
+        return (-1);
+    }
+/*
+ * Status channel, where the successor signals readiness. 
+ * EOF denotes, that execve(2) failed or the successor exited.
+ */    
+    if (pipe2(st, O_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "Can't upgrade, because of %s", strerror(errno));
+        return (-1);
+    }
+    
+    (void)snprintf(buf, sizeof(buf), "%d", sod_lfd);
+    (void)snprintf(sbuf, sizeof(sbuf), "%d", st[1]);
+    
+    if (setenv(SOD_LISTEN_FD_ENV, buf, 1) < 0 
+        || setenv(SOD_STATUS_FD_ENV, sbuf, 1) < 0) {
+        syslog(LOG_ERR, "Can't upgrade, because of %s", strerror(errno));
+        (void)unsetenv(SOD_LISTEN_FD_ENV);
+        (void)unsetenv(SOD_STATUS_FD_ENV);
+        (void)close(st[0]);
+        (void)close(st[1]);
+        return (-1);
+    }
+    
+    if ((cpid = fork()) == 0) {
+        (void)close(st[0]);
+        (void)fcntl(st[1], F_SETFD, 0);
+        (void)sigemptyset(&oset);
+        (void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+        
+        (void)execv(sod_argv[0], sod_argv);
+        _exit(EX_OSERR);
+    }
+    (void)unsetenv(SOD_LISTEN_FD_ENV);
+    (void)unsetenv(SOD_STATUS_FD_ENV);
+    (void)close(st[1]);
+    
+    if (cpid < 0) {
+        syslog(LOG_ERR, "Can't upgrade, because of %s", strerror(errno));
+        (void)close(st[0]);
+        return (-1);
+    }
+/*
+ * Release lock on pid file, successor awaits it.
+ */    
+    (void)close(sod_pidfd);
+    sod_pidfd = -1;
+    
+    sod_status = st[0];
+    sod_status_dl = sod_clock() + (uint64_t)SOD_UPGRADE_TIMO * 1000000;
+    
+    syslog(LOG_INFO, "Executed %s, awaiting its readiness", sod_argv[0]);
+    
+    return (0);
+}
+
+/*
+ * Called, when the status channel became readable or timed out. 
+ * If the successor is ready, stop accepting connections and drain 
+ * in-flight transactions. Otherwise, keep serving and retake the 
+ * lock on pid file.
+ */
+static void
+sod_upgrade_done(int readable)
+{
+    char c;
+    ssize_t n;
+    
+    n = (readable != 0) ? read(sod_status, &c, 1) : -1;
+    
+    (void)close(sod_status);
+    sod_status = -1;
+    
+    if (n == 1) {
+        sod_handoff = 1;
+        (void)close(sod_lfd);
+        sod_lfd = -1;
+        
+        syslog(LOG_INFO, "Listening socket passed to successor, "
+            "draining in-flight transactions");
+        return;
+    }
+    syslog(LOG_ERR, "Can't upgrade, because successor %s", 
+        (readable != 0) ? "exited during startup" : "is not ready in time");
+    
+    if ((sod_pidfd = open(pid_file, O_RDWR|O_CREAT|O_CLOEXEC, 0640)) < 0 
+        || lockf(sod_pidfd, F_TLOCK, 0) < 0) {
+        syslog(LOG_ERR, "Can't lock %s", pid_file);
+        return;
+    }
+    (void)snprintf(pid_file_buf, PATH_MAX, "%d\n", getpid());
+    
+    if (ftruncate(sod_pidfd, 0) < 0 
+        || write(sod_pidfd, pid_file_buf, strlen(pid_file_buf)) < 0) 
+        syslog(LOG_ERR, "Can't write %d in %s", getpid(), pid_file);
+}
+
+/*
+ * By child performed pam(8) transaction or, on session 
+ * by shared memory, transactions until its termination.
+ */
+void     
+sod_doit(const struct sod_req *sr)
 {
     struct sod_softc sc;
+
+    (void)memset(&sc, 0, sizeof(sc));
     
+    sc.sc_rmt = sr->sr_fd;
+    sc.sc_sr = sr;
+    
+    if (sr->sr_class == SOD_CLASS_RING) {
+        if ((sc.sc_ring = sod_ring_accept(sc.sc_rmt, &sc.sc_buf)) == NULL)
+            exit(EX_PROTOCOL);
+/*
+ * Terminate idle session, its applicant may have gone away 
+ * without closing the connection.
+ */        
+        sod_ring_timo(sc.sc_ring, SOD_RING_IDLE * 1000);
+        
+        while (sod_txn(&sc) > 0)
+            sc.sc_seq++;
+        
+        sod_ring_free(sc.sc_ring);
+    } else if (sod_txn(&sc) < 0) 
+        exit(EX_OSERR);
+
+    (void)memset(&sc, 0, sizeof(sc));
+}
+
+/*
+ * Perform pam(8) transaction.
+ */
+static ssize_t
+sod_txn(struct sod_softc *sc)
+{
     char host[SOD_NMAX + 1];
     char user[SOD_NMAX + 1];
+    char tok[SOD_NMAX + 1];
     
     struct pam_conv     pamc;     /* variable data */ 
     struct passwd     *pwd;   
     
-    login_cap_t *lc;
-   
-    const char     *prompt;
-    const char     *pw_prompt;
-    
     pam_handle_t     *pamh;
     
     int retries, backoff;
     int ask = 1, cnt = 0;
     int pam_err, resp;
-
-    (void)memset(&sc, 0, sizeof(sc));
-    
-    sc.sc_rmt = r;
+    uint64_t t0;
+    ssize_t n;
     
-    pamc.appdata_ptr = &sc;
+    pamc.appdata_ptr = sc;
     pamc.conv = sod_conv;
     pamh = NULL;
 /*
  * Create < hostname, user > tuple.
  */
-    if (sod_msg_fn(sod_msg_recv, sc.sc_rmt, &sc.sc_buf) < 0) 
-        exit(EX_OSERR);
+    if ((n = sod_xfer(sod_msg_recv, sc, SOD_CAP_TOK_USER)) <= 0) 
+        return (n);
+    
+    t0 = sod_clock();
  
     if (gethostname(host, SOD_NMAX) < 0) 
         exit(EX_NOHOST); 
  
-    (void)strncpy(user, sc.sc_buf.sm_tok, SOD_NMAX);
+    (void)strncpy(user, sc->sc_buf.sm_tok, SOD_NMAX);
+    user[SOD_NMAX] = '\0';
 /*
  * Verify, if username exists in passwd database. 
  */
@@ -299,58 +1011,88 @@ sod_doit(int r)
 /*
  * Parts of in login.c defined codesections are reused here.
  */   
-        switch (sc.sc_buf.sm_code) {
+        switch (sc->sc_buf.sm_code) {
         case SOD_AUTH_REQ:  
-      
-            lc = login_getclass(NULL);
-            prompt = login_getcapstr(lc, "login_prompt", 
-                prompt_default, prompt_default);
-            pw_prompt = login_getcapstr(lc, "passwd_prompt", 
-                pw_prompt_default, pw_prompt_default);
-            retries = login_getcapnum(lc, "login-retries", 
-                SOD_RETRIES_DFLT, SOD_RETRIES_DFLT);
-            backoff = login_getcapnum(lc, "login-backoff", 
-                SOD_DFLT_BACKOFF, SOD_DFLT_BACKOFF);
-            login_close(lc);
-            lc = NULL;
+/*
+ * By parent cached attributes, see sod_conf_load().
+ */      
+            retries = sod_cf.sf_retries;
+            backoff = sod_cf.sf_backoff;
+            
+            sc->sc_user = user;
        
             while (ask != 0) {
-				pam_err = pam_start("sod", user, &pamc, &pamh);
+                sc->sc_fr.fr_slot = -1;
+                sc->sc_fr.fr_err = -1;
+/*
+ * By -e the token is received in advance, thus a request 
+ * coalesced with an identical one in flight does not invoke 
+ * pam(8) at all and the token answers the first prompt of 
+ * the stack. Otherwise, the flight is keyed by the response 
+ * to the first prompt of the stack, see sod_conv().
+ */
+                if (sod_early != 0) {
+                    pam_err = sod_authtok(sc, sod_cf.sf_pw_prompt, tok);
+                    
+                    if (pam_err == PAM_SUCCESS)
+                        (void)sod_flight_enter(sc);
+                } else {
+                    pam_err = PAM_SUCCESS;
+                    sc->sc_flight = 1;
+                }
+                
+                if (pam_err == PAM_SUCCESS && sc->sc_fr.fr_err == -1) {
+					pam_err = pam_start("sod", user, &pamc, &pamh);
 /*
  * Open pam(8) session and authenticate.
  */        
-                if (pam_err == PAM_SUCCESS) 
-                    pam_err = pam_set_item(pamh, PAM_RUSER, user);
+                    if (pam_err == PAM_SUCCESS) 
+                        pam_err = pam_set_item(pamh, PAM_RUSER, user);
     
-                if (pam_err == PAM_SUCCESS) 
-                    pam_err = pam_set_item(pamh, PAM_RHOST, host);
+                    if (pam_err == PAM_SUCCESS) 
+                        pam_err = pam_set_item(pamh, PAM_RHOST, host);
 
-                if (pam_err == PAM_SUCCESS) 
-                    pam_err = pam_set_item(pamh, PAM_TTY, SOD_SOCK_FILE); 
+                    if (pam_err == PAM_SUCCESS) 
+                        pam_err = pam_set_item(pamh, PAM_TTY, 
+                            sun->sun_path); 
 
-                if (pam_err == PAM_SUCCESS) {
-                    
-                    pam_err = pam_authenticate(pamh, 0);
+                    if (pam_err == PAM_SUCCESS) 
+                        pam_err = pam_authenticate(pamh, 0);
+                }
+                sc->sc_flight = 0;
+/*
+ * Substitute result of coalesced verification, if any. 
+ * Otherwise, pass own result to waiters, if any.
+ */
+                if (sc->sc_fr.fr_err != -1)
+                    pam_err = sc->sc_fr.fr_err;
+                else
+                    sod_flight_leave(sc, pam_err);
                 
-                    if (pam_err == PAM_AUTH_ERR) {                
-						cnt += 1;
+                sc->sc_tok = NULL;
+                (void)memset(tok, 0, sizeof(tok));
+/*
+ * Failures of coalesced verification count as well.
+ */
+                if (pam_err == PAM_AUTH_ERR) {                
+					cnt += 1;
 /*
  * Reenter loop, if PAM_AUTH_ERR condition halts. 
  */         
-                        if (cnt > backoff) 
-                            (void)sleep((u_int)((cnt - backoff) * 5));
+                    if (cnt > backoff) 
+                        (void)sleep((u_int)((cnt - backoff) * 5));
         
-                        if (cnt >= retries)
-                            ask = 0;        
+                    if (cnt >= retries)
+                        ask = 0;        
     
+                    if (pamh != NULL)
                         (void)pam_end(pamh, pam_err);
         
-                        pamh = NULL;
-                    } else
-                        ask = 0;    
+                    pamh = NULL;
                 } else
                     ask = 0;    
             }
+            sc->sc_user = NULL;
 /*
  * Create response.
  */             
@@ -361,6 +1103,15 @@ sod_doit(int r)
                 
             break;
         case SOD_PASSWD_REQ:
+/*
+ * Password changes are serialized by parent, thus 
+ * those are not performed during ring sessions.
+ */
+            if (sc->sc_ring != NULL) {
+                pam_err = PAM_PERM_DENIED;
+                resp = SOD_PASSWD_REJ;
+                break;
+            }
 /*
  * Change password.
  */
@@ -406,94 +1157,16 @@ sod_doit(int r)
 /*
  * Send response.
  */      
-    sod_msg_prepare(user, resp, &sc.sc_buf);
+    sod_msg_prepare(user, resp, &sc->sc_buf);
     
-    (void)sod_msg_fn(sod_msg_send, sc.sc_rmt, &sc.sc_buf);
-
-    (void)memset(&sc, 0, sizeof(sc));
-}
-
-/*
- * During runtime of pam_get_authtok(3) conversation routine.
- */
-static int 
-sod_conv(int num_msg, const struct pam_message **msg, 
-        struct pam_response **resp, void *data) 
-{
-    struct sod_softc *sc = NULL;
-    int pam_err = PAM_AUTH_ERR;
-    int p = 1, q, i, style, j;
-    struct pam_response *tok;
+    n = sod_xfer(sod_msg_send, sc, SOD_CAP_TOK_USER);
     
-    if ((sc = data) == NULL)
-        p -= 2;
+    sod_audit_log(sc->sc_sr, user, resp, sod_clock() - t0);
 
-    if ((q = num_msg) == p) {
-        if ((tok = calloc(q, sizeof(*tok))) == NULL)
-            q = 0;
-    } else 
-        q = 0;
-        
-    for (i = 0; i < q; ++i) {
-        style = msg[i]->msg_style;
-    
-        switch (style) {
-        case PAM_PROMPT_ECHO_OFF:
-        case PAM_PROMPT_ECHO_ON:
-        case PAM_ERROR_MSG:
-        case PAM_TEXT_INFO:
-            break;
-        default:
-            style = -1;
-            break;
-        }    
-        
-        if (style < 0)
-            break; 
-                    
-        sod_msg_prepare(msg[i]->msg, SOD_AUTH_NAK, &sc->sc_buf);
-/*
- * Request PAM_AUTHTOK.
- */                
-        if (sod_msg_fn(sod_msg_send, sc->sc_rmt, &sc->sc_buf) < 0)
-            break;
-/*
- * Await response from applicant.
- */    
-        if (sod_msg_fn(sod_msg_recv, sc->sc_rmt, &sc->sc_buf) < 0)
-            break; 
-            
-        if (sc->sc_buf.sm_code != SOD_AUTH_REQ)
-            break;
-        
-        if ((tok[i].resp = calloc(1, SOD_NMAX + 1)) == NULL) 
-            break;
-
-        (void)strncpy(tok[i].resp, sc->sc_buf.sm_tok, SOD_NMAX);
-        (void)memset(&sc->sc_buf, 0, sizeof(sc->sc_buf));
-    }
+    (void)memset(&sc->sc_buf, 0, sizeof(sc->sc_buf));
+    (void)memset(user, 0, sizeof(user));
     
-    if (i < q) {
-/*
- * Cleanup, if something went wrong.
- */
-        for (j = i, i = 0; i < j; ++i) { 
-            (void)memset(tok[i].resp, 0, SOD_NMAX);
-            free(tok[i].resp);
-            tok[i].resp = NULL;
-        }
-        (void)memset(tok, 0, q * sizeof(*tok));
-        free(tok);
-        tok = NULL;
-    } else {
-/*
- * Self explanatory.
- */        
-        if (i > 0 && p > 0) 
-            pam_err = PAM_SUCCESS;    
-    }    
-    *resp = tok;
-    return (pam_err);
+    return (n);
 }
 
 /*
@@ -502,6 +1175,7 @@ sod_conv(int num_msg, const struct pam_message **msg,
 static void *
 sod_sigaction(void *arg __unused)
 {
+    char cmd;
     int sig;
     
     for (;;) {
@@ -515,13 +1189,25 @@ sod_sigaction(void *arg __unused)
         
         switch (sig) {
         case SIGHUP:
+            cmd = SOD_CMD_RELOAD;
+            (void)write(sod_cmd[1], &cmd, sizeof(cmd));
+            break;
+        case SIGUSR1:
+            cmd = SOD_CMD_STATS;
+            (void)write(sod_cmd[1], &cmd, sizeof(cmd));
+            break;
+        case SIGUSR2:
+            cmd = SOD_CMD_UPGRADE;
+            (void)write(sod_cmd[1], &cmd, sizeof(cmd));
+            break;
+        case SIGCHLD:
+            cmd = SOD_CMD_REAP;
+            (void)write(sod_cmd[1], &cmd, sizeof(cmd));
+            break;
         case SIGINT:
         case SIGKILL:    
         case SIGTERM:
-            
-            (void)unlink(sun->sun_path);
-            (void)unlink(pid_file);
-            
+            sod_cleanup();
             exit(EX_OK);
             break;
         default:    
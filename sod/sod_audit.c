@@ -0,0 +1,574 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "sod_rec.h"
+#include "sod_var.h"
+
+/*
+ * Audit of transactions.
+ *
+ * Any child pushes a record of fixed size per transaction into a 
+ * bounded multi-producer queue, where any slot carries a sequence 
+ * number denoting its state, as described by D. Vyukov. The queue 
+ * resides in anonymous shared memory, mapped by parent before any 
+ * fork(2). Thus pushing a record costs neither a system call nor 
+ * a lock. If the queue is full, the record is dropped and counted.
+ *
+ * The queue is drained periodically in batches by a logger process, 
+ * which writes records by syslog(3) or appends those to a binary or 
+ * JSON-lines file. A slot reserved by a producer, but not published 
+ * in time, e. g. because its child was killed in between, is skipped 
+ * and counted as lost. The audit file is reopened by the logger, when 
+ * its parent passes SOD_AUDIT_REOPEN by pipe on SIGHUP, thus it may 
+ * be rotated. The logger terminates after draining, when the write 
+ * end of its pipe is closed by exit of its parent. 
+ */
+
+#define SOD_AUDIT_SLOTS     4096     /* power of 2 */
+#define SOD_AUDIT_BATCH     256
+#define SOD_AUDIT_INTERVAL     100     /* msec */
+#define SOD_AUDIT_JSON_MAX     1024     /* by record */
+#define SOD_AUDIT_STALE     1000000     /* usec, until reserved slot is lost */
+#define SOD_AUDIT_REOPEN     'h'
+
+#define SOD_AUDIT_SYSLOG     0
+#define SOD_AUDIT_BIN     1
+#define SOD_AUDIT_JSON     2
+
+struct sod_audit_slot {
+    alignas(64) atomic_uint_fast64_t     as_seq;
+    struct sod_audit_rec     as_rec;
+};
+
+struct sod_audit_q {
+    alignas(64) atomic_uint_fast64_t     aq_head;     /* by producers */
+    alignas(64) atomic_uint_fast64_t     aq_tail;     /* by logger */
+    alignas(64) atomic_uint_fast64_t     aq_pushed;
+    atomic_uint_fast64_t     aq_dropped;
+    atomic_uint_fast64_t     aq_lost;     /* reserved, never published */
+    atomic_uint_fast64_t     aq_written;
+    atomic_uint_fast64_t     aq_batches;
+    struct sod_audit_slot     aq_slot[SOD_AUDIT_SLOTS];
+};
+
+static struct sod_audit_q     *sod_audit_q;
+static int     sod_audit_type;
+static const char     *sod_audit_path;
+static int     sod_audit_fd = -1;     /* audit file */
+static int     sod_audit_pipe = -1;     /* write end, by parent */
+
+static uint64_t     sod_audit_stall;     /* by logger, reserved slot */
+static uint64_t     sod_audit_stall_t0;
+
+static int     sod_audit_file(const char *);
+static void     sod_audit_logger(int);
+static size_t     sod_audit_drain(struct sod_audit_rec *, size_t);
+static int     sod_audit_stale(struct sod_audit_slot *, uint64_t);
+static void     sod_audit_write(const struct sod_audit_rec *, size_t);
+static size_t     sod_audit_json(char *, size_t, const struct sod_audit_rec *);
+static const char *     sod_audit_class(int);
+
+/*
+ * Parse target by -A option, open audit file 
+ * and map queue. Must precede any fork(2).
+ */
+int
+sod_audit_open(const char *spec)
+{
+    uint64_t i;
+    
+    if (strcmp(spec, "syslog") == 0) {
+        sod_audit_type = SOD_AUDIT_SYSLOG;
+        sod_audit_path = NULL;
+    } else if (strncmp(spec, "bin:", 4) == 0) {
+        sod_audit_type = SOD_AUDIT_BIN;
+        sod_audit_path = spec + 4;
+    } else if (strncmp(spec, "json:", 5) == 0) {
+        sod_audit_type = SOD_AUDIT_JSON;
+        sod_audit_path = spec + 5;
+    } else {
+        errno = EINVAL;
+        return (-1);
+    }
+    
+    if (sod_audit_path != NULL 
+        && (sod_audit_fd = sod_audit_file(sod_audit_path)) < 0)
+        return (-1);
+    
+    sod_audit_q = mmap(NULL, sizeof(*sod_audit_q), PROT_READ|PROT_WRITE, 
+        MAP_SHARED|MAP_ANON, -1, 0);
+    
+    if (sod_audit_q == MAP_FAILED) {
+        sod_audit_q = NULL;
+        
+        if (sod_audit_fd > -1)
+            (void)close(sod_audit_fd);
+        
+        sod_audit_fd = -1;
+        
+        return (-1);
+    }
+    
+    for (i = 0; i < SOD_AUDIT_SLOTS; i++) 
+        atomic_init(&sod_audit_q->aq_slot[i].as_seq, i);
+    
+    return (0);
+}
+
+/*
+ * Open audit file for appending. Returns its descriptor.
+ */
+static int
+sod_audit_file(const char *path)
+{
+    struct sod_audit_hdr ah;
+    struct stat st;
+    int fd;
+    
+    if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0600)) < 0)
+        return (-1);
+    
+    if (fstat(fd, &st) < 0)
+        goto bad;
+/*
+ * Append to binary audit file of former instance, if any.
+ */        
+    if (sod_audit_type == SOD_AUDIT_BIN && st.st_size == 0) {
+        (void)memset(&ah, 0, sizeof(ah));
+        ah.ah_magic = SOD_AUDIT_MAGIC;
+        ah.ah_version = SOD_AUDIT_VERSION;
+        
+        if (write(fd, &ah, sizeof(ah)) != sizeof(ah))
+            goto bad;
+    }
+    return (fd);
+bad:
+    (void)close(fd);
+    
+    return (-1);
+}
+
+/*
+ * Fork logger. Its pipe is not inherited by a successor,
+ * thus the logger of a predecessor drains until its exit.
+ */
+int
+sod_audit_start(void)
+{
+    int fds[2];
+    pid_t pid;
+    
+    if (sod_audit_q == NULL)
+        return (0);
+    
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return (-1);
+    
+    if ((pid = fork()) < 0) {
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        return (-1);
+    }
+    
+    if (pid == 0) {
+        (void)close(fds[1]);
+        sod_detach();
+        sod_audit_logger(fds[0]);
+        _exit(EX_OK);
+    }
+    (void)close(fds[0]);
+/*
+ * A busy logger must not block its parent.
+ */    
+    (void)fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    
+    sod_audit_pipe = fds[1];
+    
+    return (0);
+}
+
+/*
+ * Request logger to reopen audit file, by parent on SIGHUP.
+ */
+void
+sod_audit_reopen(void)
+{
+    char cmd = SOD_AUDIT_REOPEN;
+    
+    if (sod_audit_pipe > -1 && sod_audit_path != NULL)
+        (void)write(sod_audit_pipe, &cmd, sizeof(cmd));
+}
+
+/*
+ * Release write end of pipe, thus the 
+ * logger recognizes exit of its parent.
+ */
+void
+sod_audit_detach(void)
+{
+    
+    if (sod_audit_pipe > -1)
+        (void)close(sod_audit_pipe);
+    
+    sod_audit_pipe = -1;
+}
+
+/*
+ * Push record, by child. Never blocks.
+ */
+void
+sod_audit_log(const struct sod_req *sr, const char *user, int code, 
+        uint64_t duration)
+{
+    struct sod_audit_q *aq = sod_audit_q;
+    struct sod_audit_slot *as;
+    struct sod_audit_rec *ar;
+    struct timespec ts;
+    uint64_t pos, seq;
+    
+    if (aq == NULL)
+        return;
+    
+    pos = atomic_load_explicit(&aq->aq_head, memory_order_relaxed);
+    
+    for (;;) {
+        as = &aq->aq_slot[pos & (SOD_AUDIT_SLOTS - 1)];
+        seq = atomic_load_explicit(&as->as_seq, memory_order_acquire);
+        
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&aq->aq_head, 
+                &pos, pos + 1, memory_order_relaxed, 
+                memory_order_relaxed))
+                break;
+        } else if ((int64_t)(seq - pos) < 0) {
+            atomic_fetch_add_explicit(&aq->aq_dropped, 1, 
+                memory_order_relaxed);
+            return;
+        } else 
+            pos = atomic_load_explicit(&aq->aq_head, memory_order_relaxed);
+    }
+    ar = &as->as_rec;
+    
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    
+    ar->ar_time = (uint64_t)ts.tv_sec * 1000000 + 
+        (uint64_t)ts.tv_nsec / 1000;
+    ar->ar_duration = duration;
+    ar->ar_txn = (sr != NULL) ? sr->sr_txn : 0;
+    ar->ar_uid = (sr != NULL) ? (uint32_t)sr->sr_uid : (uint32_t)-1;
+    ar->ar_class = (sr != NULL) ? sr->sr_class : -1;
+    ar->ar_code = code;
+    (void)strncpy(ar->ar_user, user, SOD_NMAX);
+    ar->ar_user[SOD_NMAX] = '\0';
+/*
+ * Publish slot, unless the logger skipped it as lost meanwhile.
+ */    
+    if (atomic_compare_exchange_strong_explicit(&as->as_seq, &seq, 
+        pos + 1, memory_order_release, memory_order_relaxed))
+        atomic_fetch_add_explicit(&aq->aq_pushed, 1, memory_order_relaxed);
+}
+
+/*
+ * Report counters by syslog(3), by parent.
+ */
+void
+sod_audit_stats(void)
+{
+    struct sod_audit_q *aq = sod_audit_q;
+    
+    if (aq == NULL)
+        return;
+    
+    syslog(LOG_INFO, "audit: pushed %ju dropped %ju lost %ju written %ju "
+        "batches %ju", 
+        (uintmax_t)atomic_load(&aq->aq_pushed), 
+        (uintmax_t)atomic_load(&aq->aq_dropped), 
+        (uintmax_t)atomic_load(&aq->aq_lost), 
+        (uintmax_t)atomic_load(&aq->aq_written), 
+        (uintmax_t)atomic_load(&aq->aq_batches));
+}
+
+/*
+ * Main loop of logger.
+ */
+static void
+sod_audit_logger(int fd)
+{
+    struct sod_audit_rec *batch;
+    struct pollfd pfd;
+    uint64_t dropped, lost, reported = 0, reported_lost = 0;
+    size_t n;
+    char cmd;
+    int eof = 0, nfd;
+    
+    if ((batch = calloc(SOD_AUDIT_BATCH, sizeof(*batch))) == NULL) {
+        syslog(LOG_ERR, "audit: Can't allocate batch");
+        _exit(EX_OSERR);
+    }
+    
+    while (eof == 0) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        if (poll(&pfd, 1, SOD_AUDIT_INTERVAL) > 0 && pfd.revents != 0) {
+            if (read(fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+                eof = 1;
+        } else
+            cmd = 0;
+        
+        while ((n = sod_audit_drain(batch, SOD_AUDIT_BATCH)) > 0) 
+            sod_audit_write(batch, n);
+/*
+ * Records queued before reopening are written to the former file.
+ */        
+        if (eof == 0 && cmd == SOD_AUDIT_REOPEN) {
+            if ((nfd = sod_audit_file(sod_audit_path)) > -1) {
+                (void)close(sod_audit_fd);
+                sod_audit_fd = nfd;
+            } else 
+                syslog(LOG_ERR, "audit: Can't reopen %s: %m", 
+                    sod_audit_path);
+        }
+/*
+ * Report drops and losses, once per interval.
+ */        
+        dropped = atomic_load_explicit(&sod_audit_q->aq_dropped, 
+            memory_order_relaxed);
+        
+        if (dropped != reported) {
+            syslog(LOG_WARNING, "audit: %ju records dropped", 
+                (uintmax_t)(dropped - reported));
+            reported = dropped;
+        }
+        lost = atomic_load_explicit(&sod_audit_q->aq_lost, 
+            memory_order_relaxed);
+        
+        if (lost != reported_lost) {
+            syslog(LOG_WARNING, "audit: %ju records lost", 
+                (uintmax_t)(lost - reported_lost));
+            reported_lost = lost;
+        }
+    }
+    free(batch);
+}
+
+/*
+ * Pop up to max records. Draining stops at a slot, which is 
+ * reserved but not yet published, unless it is stale.
+ */
+static size_t
+sod_audit_drain(struct sod_audit_rec *batch, size_t max)
+{
+    struct sod_audit_q *aq = sod_audit_q;
+    struct sod_audit_slot *as;
+    uint64_t pos, seq;
+    size_t n = 0;
+    
+    pos = atomic_load_explicit(&aq->aq_tail, memory_order_relaxed);
+    
+    while (n < max) {
+        as = &aq->aq_slot[pos & (SOD_AUDIT_SLOTS - 1)];
+        seq = atomic_load_explicit(&as->as_seq, memory_order_acquire);
+        
+        if (seq == pos + 1) {
+            batch[n++] = as->as_rec;
+/*
+ * Release slot for next round.
+ */        
+            atomic_store_explicit(&as->as_seq, pos + SOD_AUDIT_SLOTS, 
+                memory_order_release);
+        } else if (seq != pos || sod_audit_stale(as, pos) == 0)
+            break;
+        
+        pos++;
+    }
+    atomic_store_explicit(&aq->aq_tail, pos, memory_order_relaxed);
+    
+    return (n);
+}
+
+/*
+ * A slot reserved for longer than SOD_AUDIT_STALE is left behind 
+ * by a killed producer, otherwise the queue would remain stuck 
+ * and any further record dropped. Such is released for the next 
+ * round and counted as lost. A producer publishing it late fails 
+ * by sod_audit_log(). Returns 1, if skipped.
+ */
+static int
+sod_audit_stale(struct sod_audit_slot *as, uint64_t pos)
+{
+    struct sod_audit_q *aq = sod_audit_q;
+    uint64_t head, now, seq = pos;
+    
+    head = atomic_load_explicit(&aq->aq_head, memory_order_relaxed);
+/*
+ * Queue is empty, if not reserved.
+ */    
+    if ((int64_t)(head - pos) <= 0) 
+        return (0);
+    
+    now = sod_clock();
+    
+    if (sod_audit_stall != pos || sod_audit_stall_t0 == 0) {
+        sod_audit_stall = pos;
+        sod_audit_stall_t0 = now;
+        return (0);
+    }
+    
+    if (now - sod_audit_stall_t0 < SOD_AUDIT_STALE)
+        return (0);
+    
+    if (atomic_compare_exchange_strong_explicit(&as->as_seq, &seq, 
+        pos + SOD_AUDIT_SLOTS, memory_order_acq_rel, memory_order_relaxed) 
+        == 0)
+        return (0);
+    
+    sod_audit_stall_t0 = 0;
+    atomic_fetch_add_explicit(&aq->aq_lost, 1, memory_order_relaxed);
+    
+    return (1);
+}
+
+/*
+ * Write batch of records.
+ */
+static void
+sod_audit_write(const struct sod_audit_rec *batch, size_t n)
+{
+    char *buf, *bp;
+    size_t i, len;
+    
+    switch (sod_audit_type) {
+    case SOD_AUDIT_SYSLOG:
+        for (i = 0; i < n; i++) {
+            syslog(LOG_AUTH|LOG_INFO, "audit: user %s uid %ju class %s "
+                "result %s code %#x duration %ju usec txn %u", 
+                batch[i].ar_user, (uintmax_t)batch[i].ar_uid, 
+                sod_audit_class(batch[i].ar_class), 
+                ((batch[i].ar_code & SOD_MSG_REJ) == SOD_MSG_ACK) ? 
+                    "accept" : "reject", 
+                (unsigned int)batch[i].ar_code, 
+                (uintmax_t)batch[i].ar_duration, batch[i].ar_txn);
+        }
+        break;
+    case SOD_AUDIT_BIN:
+        len = n * sizeof(*batch);
+        
+        if (write(sod_audit_fd, batch, len) != (ssize_t)len)
+            syslog(LOG_ERR, "audit: Can't write %zu records", n);
+        break;
+    case SOD_AUDIT_JSON:
+        if ((buf = malloc(n * SOD_AUDIT_JSON_MAX)) == NULL) {
+            syslog(LOG_ERR, "audit: Can't write %zu records", n);
+            break;
+        }
+        
+        for (i = 0, bp = buf; i < n; i++) 
+            bp += sod_audit_json(bp, SOD_AUDIT_JSON_MAX, &batch[i]);
+        
+        len = (size_t)(bp - buf);
+        
+        if (write(sod_audit_fd, buf, len) != (ssize_t)len)
+            syslog(LOG_ERR, "audit: Can't write %zu records", n);
+        
+        free(buf);
+        break;
+    default:
+        break;
+    }
+    atomic_fetch_add_explicit(&sod_audit_q->aq_written, n, 
+        memory_order_relaxed);
+    atomic_fetch_add_explicit(&sod_audit_q->aq_batches, 1, 
+        memory_order_relaxed);
+}
+
+/*
+ * Format record as JSON object, terminated by newline. The 
+ * username is chosen by applicant, thus any byte outside of 
+ * printable ASCII is escaped.
+ */
+static size_t
+sod_audit_json(char *buf, size_t size, const struct sod_audit_rec *ar)
+{
+    char user[6 * SOD_NMAX + 1];
+    const unsigned char *s;
+    size_t i;
+    int n;
+    
+    for (s = (const unsigned char *)ar->ar_user, i = 0; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            user[i++] = '\\';
+            user[i++] = (char)*s;
+        } else if (*s < 0x20 || *s > 0x7e) {
+            (void)snprintf(user + i, 7, "\\u%04x", *s);
+            i += 6;
+        } else 
+            user[i++] = (char)*s;
+    }
+    user[i] = '\0';
+    
+    n = snprintf(buf, size, "{\"time\":%ju,\"user\":\"%s\",\"uid\":%ju,"
+        "\"class\":\"%s\",\"result\":\"%s\",\"code\":%d,"
+        "\"duration_us\":%ju,\"txn\":%u}\n", 
+        (uintmax_t)ar->ar_time, user, (uintmax_t)ar->ar_uid, 
+        sod_audit_class(ar->ar_class), 
+        ((ar->ar_code & SOD_MSG_REJ) == SOD_MSG_ACK) ? "accept" : "reject", 
+        ar->ar_code, (uintmax_t)ar->ar_duration, ar->ar_txn);
+    
+    return ((n < 0 || (size_t)n >= size) ? 0 : (size_t)n);
+}
+
+static const char *
+sod_audit_class(int class)
+{
+    
+    if (class < 0 || class >= SOD_CLASS_MAX)
+        return ("none");
+    
+    return (sod_classes[class].sk_name);
+}
@@ -0,0 +1,164 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "sod_rec.h"
+#include "sod_var.h"
+
+/*
+ * Capture of transactions for replay by sod_test(1).
+ *
+ * The capture file is opened by parent and inherited by any 
+ * forked child. Records are of fixed size and appended by a 
+ * single write(2), thus records of concurrently performed 
+ * transactions are not interleaved. Usernames are replaced 
+ * by their keyed hash, where the key is regenerated on any 
+ * startup and never written. Thus records are denoted by a 
+ * random instance, regenerated on any startup as well.
+ */
+
+static int     sod_cap_fd = -1;
+static uint32_t     sod_cap_inst;
+static uint8_t     sod_cap_key[SOD_HASH_KEYLEN];
+
+static uint8_t     sod_cap_ord(struct sod_softc *);
+
+int
+sod_cap_open(const char *path)
+{
+    struct sod_cap_hdr ch;
+    struct stat st;
+    int fd;
+    
+    if ((fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600)) < 0) 
+        return (-1);
+    
+    if (fstat(fd, &st) < 0) 
+        goto bad;
+/*
+ * Append to capture file of former instance, if any, 
+ * unless written in another format.
+ */    
+    if (st.st_size == 0) {
+        (void)memset(&ch, 0, sizeof(ch));
+        ch.ch_magic = SOD_CAP_MAGIC;
+        ch.ch_version = SOD_CAP_VERSION;
+        
+        if (write(fd, &ch, sizeof(ch)) != sizeof(ch))
+            goto bad;
+    } else if (pread(fd, &ch, sizeof(ch), 0) != sizeof(ch) 
+        || ch.ch_magic != SOD_CAP_MAGIC 
+        || ch.ch_version != SOD_CAP_VERSION) {
+        errno = EINVAL;
+        goto bad;
+    }
+    arc4random_buf(sod_cap_key, sizeof(sod_cap_key));
+    arc4random_buf(&sod_cap_inst, sizeof(sod_cap_inst));
+    
+    sod_cap_fd = fd;
+    
+    return (0);
+bad:
+    (void)close(fd);
+    return (-1);
+}
+
+/*
+ * Record message, where its token is replaced by class. The
+ * username is taken from the request of the transaction, 
+ * because a session performs transactions of any username.
+ */
+void
+sod_cap_log(struct sod_softc *sc, int dir, int tok)
+{
+    struct sod_msg *sm = &sc->sc_buf;
+    struct sod_cap_rec cr;
+    
+    if (sod_cap_fd < 0 || sc->sc_sr == NULL)
+        return;
+    
+    (void)memset(&cr, 0, sizeof(cr));
+    
+    if (dir == SOD_CAP_IN && tok == SOD_CAP_TOK_USER) {
+        sc->sc_cap_user = (uint32_t)sod_siphash(sod_cap_key, 
+            sm->sm_tok, strnlen(sm->sm_tok, SOD_NMAX));
+        sc->sc_cap_ntok = 0;
+    } else if (dir == SOD_CAP_IN && tok == SOD_CAP_TOK_AUTHTOK) 
+        cr.cr_ord = sod_cap_ord(sc);
+    
+    cr.cr_time = sod_clock();
+    cr.cr_inst = sod_cap_inst;
+    cr.cr_txn = sc->sc_sr->sr_txn;
+    cr.cr_seq = sc->sc_seq;
+    cr.cr_user = sc->sc_cap_user;
+    cr.cr_code = sm->sm_code;
+    cr.cr_dir = (uint16_t)dir;
+    cr.cr_tok = (uint16_t)tok;
+    
+    if (write(sod_cap_fd, &cr, sizeof(cr)) != sizeof(cr)) {
+        syslog(LOG_ERR, "Can't write capture, because of %s", 
+            strerror(errno));
+    }
+}
+
+/*
+ * Ordinal of received response among distinct ones of the 
+ * transaction, where responses are compared by their keyed 
+ * hash, which is not recorded. Returns 0, if exhausted.
+ */
+static uint8_t
+sod_cap_ord(struct sod_softc *sc)
+{
+    uint64_t h;
+    int i;
+    
+    h = sod_siphash(sod_cap_key, sc->sc_buf.sm_tok, 
+        strnlen(sc->sc_buf.sm_tok, SOD_NMAX));
+    
+    for (i = 0; i < sc->sc_cap_ntok; i++) {
+        if (sc->sc_cap_tok[i] == h)
+            return ((uint8_t)(i + 1));
+    }
+    
+    if (i == SOD_CAP_TOKS)
+        return (0);
+    
+    sc->sc_cap_tok[sc->sc_cap_ntok++] = h;
+    
+    return ((uint8_t)sc->sc_cap_ntok);
+}
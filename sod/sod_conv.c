@@ -0,0 +1,210 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+
+#include <security/pam_appl.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sod.h>
+
+#include "sod_rec.h"
+#include "sod_var.h"
+
+/*
+ * Conversation with applicant, separated from sod.c, 
+ * thus it is linked by benchmarks with fake pam(3).
+ */
+
+/*
+ * During runtime of pam_get_authtok(3) conversation routine.
+ */
+int 
+sod_conv(int num_msg, const struct pam_message **msg, 
+        struct pam_response **resp, void *data) 
+{
+    struct sod_softc *sc = NULL;
+    int pam_err = PAM_AUTH_ERR;
+    int p = 1, q, i, style, j;
+    struct pam_response *tok = NULL;
+    
+    if ((sc = data) == NULL)
+        p -= 2;
+
+    if ((q = num_msg) == p) {
+        if ((tok = calloc(q, sizeof(*tok))) == NULL)
+            q = 0;
+    } else 
+        q = 0;
+        
+    for (i = 0; i < q; ++i) {
+        style = msg[i]->msg_style;
+    
+        switch (style) {
+        case PAM_PROMPT_ECHO_OFF:
+        case PAM_PROMPT_ECHO_ON:
+        case PAM_ERROR_MSG:
+        case PAM_TEXT_INFO:
+            break;
+        default:
+            style = -1;
+            break;
+        }    
+        
+        if (style < 0)
+            break; 
+/*
+ * The first prompt for PAM_AUTHTOK is answered by the in 
+ * advance received token. If prompted again, the result 
+ * depends on further tokens, thus it is not passed to 
+ * coalesced requests, see sod_flight.c.
+ */
+        if (style == PAM_PROMPT_ECHO_OFF && sc->sc_tok != NULL) {
+            if ((tok[i].resp = calloc(1, SOD_NMAX + 1)) == NULL) 
+                break;
+            
+            (void)strncpy(tok[i].resp, sc->sc_tok, SOD_NMAX);
+            tok[i].resp[SOD_NMAX] = '\0';
+            sc->sc_tok = NULL;
+            continue;
+        }
+        
+        if (style == PAM_PROMPT_ECHO_OFF && sc->sc_user != NULL)
+            sod_flight_leave(sc, -1);
+                    
+        sod_msg_prepare(msg[i]->msg, SOD_AUTH_NAK, &sc->sc_buf);
+/*
+ * Request PAM_AUTHTOK.
+ */                
+        if (sod_xfer(sod_msg_send, sc, SOD_CAP_TOK_PROMPT) < 0)
+            break;
+/*
+ * Await response from applicant.
+ */    
+        if (sod_xfer(sod_msg_recv, sc, SOD_CAP_TOK_AUTHTOK) < 0)
+            break; 
+            
+        if (sc->sc_buf.sm_code != SOD_AUTH_REQ)
+            break;
+        
+        if ((tok[i].resp = calloc(1, SOD_NMAX + 1)) == NULL) 
+            break;
+
+        (void)strncpy(tok[i].resp, sc->sc_buf.sm_tok, SOD_NMAX);
+        tok[i].resp[SOD_NMAX] = '\0';
+        (void)memset(&sc->sc_buf, 0, sizeof(sc->sc_buf));
+/*
+ * Await identical authentication in flight, if any, keyed by 
+ * response to first prompt for PAM_AUTHTOK. Its result is 
+ * substituted by sod_txn(), thus the stack is aborted.
+ */
+        if (style == PAM_PROMPT_ECHO_OFF && sc->sc_flight != 0) {
+            sc->sc_flight = 0;
+            sc->sc_tok = tok[i].resp;
+            
+            if (sod_flight_enter(sc) != 0) {
+                (void)memset(tok[i].resp, 0, SOD_NMAX);
+                free(tok[i].resp);
+                tok[i].resp = NULL;
+                sc->sc_tok = NULL;
+                break;
+            }
+            sc->sc_tok = NULL;
+        }
+    }
+    
+    if (i < q) {
+/*
+ * Cleanup, if something went wrong.
+ */
+        for (j = i, i = 0; i < j; ++i) { 
+            (void)memset(tok[i].resp, 0, SOD_NMAX);
+            free(tok[i].resp);
+            tok[i].resp = NULL;
+        }
+        (void)memset(tok, 0, q * sizeof(*tok));
+        free(tok);
+        tok = NULL;
+    } else {
+/*
+ * Self explanatory.
+ */        
+        if (i > 0 && p > 0) 
+            pam_err = PAM_SUCCESS;    
+    }    
+    *resp = tok;
+    return (pam_err);
+}
+
+/*
+ * Request PAM_AUTHTOK by prompt in advance of pam_authenticate(3), 
+ * it is stored into tok and passed by sc_tok to sod_conv().
+ */
+int
+sod_authtok(struct sod_softc *sc, const char *prompt, char *tok)
+{
+    int pam_err = PAM_CONV_ERR;
+    
+    sod_msg_prepare(prompt, SOD_AUTH_NAK, &sc->sc_buf);
+    
+    if (sod_xfer(sod_msg_send, sc, SOD_CAP_TOK_PROMPT) > 0 
+        && sod_xfer(sod_msg_recv, sc, SOD_CAP_TOK_AUTHTOK) > 0 
+        && sc->sc_buf.sm_code == SOD_AUTH_REQ) {
+        (void)strncpy(tok, sc->sc_buf.sm_tok, SOD_NMAX);
+        tok[SOD_NMAX] = '\0';
+        
+        sc->sc_tok = tok;
+        pam_err = PAM_SUCCESS;
+    }
+    (void)memset(&sc->sc_buf, 0, sizeof(sc->sc_buf));
+    
+    return (pam_err);
+}
+
+/*
+ * Performs MPI exchange and records it, if captured.
+ */
+ssize_t
+sod_xfer(sod_msg_fn_t fn, struct sod_softc *sc, int tok)
+{
+    ssize_t n;
+    
+    if (sc->sc_ring != NULL) {
+        n = (fn == sod_msg_recv) ? 
+            sod_ring_recv(sc->sc_ring, &sc->sc_buf) : 
+            sod_ring_send(sc->sc_ring, &sc->sc_buf);
+    } else 
+        n = sod_msg_fn(fn, sc->sc_rmt, &sc->sc_buf);
+    
+    if (n > 0) {
+        sod_cap_log(sc, (fn == sod_msg_recv) ? 
+            SOD_CAP_IN : SOD_CAP_OUT, tok);
+    }
+    return (n);
+}
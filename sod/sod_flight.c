@@ -0,0 +1,361 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <security/pam_appl.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <sod.h>
+
+#include "sod_var.h"
+
+/*
+ * Coalescing of identical authentication requests.
+ *
+ * While a child verifies a token for some user, any other child 
+ * receiving the same < user, token > tuple awaits its result instead 
+ * of running pam_authenticate(3) on its own. The token is either the 
+ * response to the first prompt of the stack, where a request answered 
+ * by the result of another aborts its stack, or by -e received in 
+ * advance of pam_start(3), where such does not invoke pam(3) at all. 
+ * Tuples are identified by their keyed hash, thus tokens are not 
+ * stored. The table resides in anonymous shared memory, mapped by 
+ * parent before any fork(2), and is guarded by a process-shared 
+ * robust mutex.
+ *
+ * Results are passed only to requests, which joined while their 
+ * verification was in flight. Completed results are not cached.
+ */
+
+#define SOD_FLIGHT_SLOTS     64
+#define SOD_FLIGHT_TIMO     10000000     /* usec */
+
+#define SOD_FLIGHT_FREE     0
+#define SOD_FLIGHT_BUSY     1     /* verified by leader */
+#define SOD_FLIGHT_DONE     2     /* result pending for waiters */
+
+struct sod_flight_slot {
+    uint64_t     fs_key[2];
+    uint64_t     fs_t0;
+    uint32_t     fs_gen;
+    int     fs_state;
+    int     fs_err;     /* by leader returned pam_err */
+    int     fs_waiters;
+};
+
+struct sod_flight_tab {
+    pthread_mutex_t     ft_mtx;
+    pthread_cond_t     ft_cv;
+    uint64_t     ft_led;
+    uint64_t     ft_coalesced;
+    uint64_t     ft_abandoned;
+    uint64_t     ft_full;
+    struct sod_flight_slot     ft_slot[SOD_FLIGHT_SLOTS];
+};
+
+static struct sod_flight_tab     *sod_flight_tab;
+static uint8_t     sod_flight_key[2 * SOD_HASH_KEYLEN];
+
+static int     sod_flight_lock(struct sod_flight_tab *);
+static void     sod_flight_release(struct sod_flight_tab *, 
+    struct sod_flight_slot *, int);
+
+/*
+ * Map table. Must precede any fork(2).
+ */
+int
+sod_flight_init(void)
+{
+    struct sod_flight_tab *ft;
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
+    int error;
+    
+    ft = mmap(NULL, sizeof(*ft), PROT_READ|PROT_WRITE, 
+        MAP_SHARED|MAP_ANON, -1, 0);
+    
+    if (ft == MAP_FAILED)
+        return (-1);
+    
+    (void)memset(ft, 0, sizeof(*ft));
+    
+    if ((error = pthread_mutexattr_init(&ma)) != 0)
+        goto bad;
+    
+    if ((error = pthread_mutexattr_setpshared(&ma, 
+        PTHREAD_PROCESS_SHARED)) == 0)
+        error = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    
+    if (error == 0)
+        error = pthread_mutex_init(&ft->ft_mtx, &ma);
+    
+    (void)pthread_mutexattr_destroy(&ma);
+    
+    if (error != 0)
+        goto bad;
+    
+    if ((error = pthread_condattr_init(&ca)) != 0)
+        goto bad;
+    
+    if ((error = pthread_condattr_setpshared(&ca, 
+        PTHREAD_PROCESS_SHARED)) == 0)
+        error = pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    
+    if (error == 0)
+        error = pthread_cond_init(&ft->ft_cv, &ca);
+    
+    (void)pthread_condattr_destroy(&ca);
+    
+    if (error != 0)
+        goto bad;
+    
+    arc4random_buf(sod_flight_key, sizeof(sod_flight_key));
+    
+    sod_flight_tab = ft;
+    
+    return (0);
+bad:
+    (void)munmap(ft, sizeof(*ft));
+    errno = error;
+    
+    return (-1);
+}
+
+/*
+ * Called by sod_conv() or sod_txn(), when the token of an 
+ * authentication request was received. Either joins an identical 
+ * request in flight and awaits its result, or leads its 
+ * verification.
+ *
+ * Returns 1, if the result was passed by fr_err, otherwise 0.
+ */
+int
+sod_flight_enter(struct sod_softc *sc)
+{
+    struct sod_flight_ref *fr = &sc->sc_fr;
+    struct sod_flight_tab *ft = sod_flight_tab;
+    struct sod_flight_slot *fs, *fl = NULL;
+    char buf[2 * (SOD_NMAX + 1)];
+    uint64_t key[2], now, dl;
+    struct timespec ts;
+    size_t ulen, tlen;
+    uint32_t gen;
+    int i, error;
+    
+    if (ft == NULL || sc->sc_user == NULL || sc->sc_tok == NULL)
+        return (0);
+    
+    ulen = strnlen(sc->sc_user, SOD_NMAX);
+    tlen = strnlen(sc->sc_tok, SOD_NMAX);
+    
+    (void)memcpy(buf, sc->sc_user, ulen);
+    buf[ulen] = '\0';
+    (void)memcpy(buf + ulen + 1, sc->sc_tok, tlen);
+    
+    key[0] = sod_siphash(sod_flight_key, buf, ulen + 1 + tlen);
+    key[1] = sod_siphash(sod_flight_key + SOD_HASH_KEYLEN, 
+        buf, ulen + 1 + tlen);
+    
+    (void)memset(buf, 0, sizeof(buf));
+    
+    if (sod_flight_lock(ft) != 0)
+        return (0);
+    
+    now = sod_clock();
+    
+    for (i = 0; i < SOD_FLIGHT_SLOTS; i++) {
+        fs = &ft->ft_slot[i];
+/*
+ * Slots are reclaimed, if abandoned by an exited child.
+ */
+        if (fs->fs_state == SOD_FLIGHT_FREE || 
+            now - fs->fs_t0 >= SOD_FLIGHT_TIMO) {
+            if (fl == NULL)
+                fl = fs;
+        } else if (fs->fs_state == SOD_FLIGHT_BUSY && 
+            fs->fs_key[0] == key[0] && fs->fs_key[1] == key[1])
+            break;
+    }
+    
+    if (i == SOD_FLIGHT_SLOTS) {
+/*
+ * Lead verification, if any slot is left.
+ */
+        if (fl != NULL) {
+            fl->fs_key[0] = key[0];
+            fl->fs_key[1] = key[1];
+            fl->fs_t0 = now;
+            fl->fs_gen += 1;
+            fl->fs_state = SOD_FLIGHT_BUSY;
+            fl->fs_err = -1;
+            fl->fs_waiters = 0;
+        
+            fr->fr_slot = (int)(fl - ft->ft_slot);
+            fr->fr_gen = fl->fs_gen;
+            ft->ft_led += 1;
+        } else 
+            ft->ft_full += 1;
+        
+        (void)pthread_mutex_unlock(&ft->ft_mtx);
+        
+        return (0);
+    }
+/*
+ * Await result until the slot times out.
+ */
+    gen = fs->fs_gen;
+    fs->fs_waiters += 1;
+    
+    dl = fs->fs_t0 + SOD_FLIGHT_TIMO;
+    ts.tv_sec = (time_t)(dl / 1000000);
+    ts.tv_nsec = (long)(dl % 1000000) * 1000;
+    
+    error = 0;
+    
+    while (fs->fs_gen == gen && fs->fs_state == SOD_FLIGHT_BUSY && 
+        error != ETIMEDOUT) {
+        error = pthread_cond_timedwait(&ft->ft_cv, &ft->ft_mtx, &ts);
+        
+        if (error == EOWNERDEAD) {
+            (void)pthread_mutex_consistent(&ft->ft_mtx);
+            error = 0;
+        }
+    }
+    
+    if (fs->fs_gen == gen) {
+        if (fs->fs_state == SOD_FLIGHT_DONE) {
+            fr->fr_err = fs->fs_err;
+            ft->ft_coalesced += 1;
+        }
+        fs->fs_waiters -= 1;
+        
+        if (fs->fs_state == SOD_FLIGHT_DONE && fs->fs_waiters == 0)
+            fs->fs_state = SOD_FLIGHT_FREE;
+    }
+    (void)pthread_mutex_unlock(&ft->ft_mtx);
+    
+    return (fr->fr_err != -1);
+}
+
+/*
+ * Called by leader, when pam_authenticate(3) returned. Results 
+ * other than PAM_SUCCESS or PAM_AUTH_ERR are not passed, because 
+ * those are not determined by the token, thus waiters proceed on 
+ * their own.
+ */
+void
+sod_flight_leave(struct sod_softc *sc, int pam_err)
+{
+    struct sod_flight_ref *fr = &sc->sc_fr;
+    struct sod_flight_tab *ft = sod_flight_tab;
+    struct sod_flight_slot *fs;
+    
+    if (ft == NULL || fr->fr_slot < 0)
+        return;
+    
+    fs = &ft->ft_slot[fr->fr_slot];
+    
+    if (sod_flight_lock(ft) == 0) {
+        if (fs->fs_gen == fr->fr_gen && fs->fs_state == SOD_FLIGHT_BUSY)
+            sod_flight_release(ft, fs, pam_err);
+        
+        (void)pthread_mutex_unlock(&ft->ft_mtx);
+    }
+    fr->fr_slot = -1;
+}
+
+/*
+ * Report counters.
+ */
+void
+sod_flight_stats(void)
+{
+    struct sod_flight_tab *ft = sod_flight_tab;
+    uint64_t led, coalesced, abandoned, full;
+    
+    if (ft == NULL || sod_flight_lock(ft) != 0)
+        return;
+    
+    led = ft->ft_led;
+    coalesced = ft->ft_coalesced;
+    abandoned = ft->ft_abandoned;
+    full = ft->ft_full;
+    
+    (void)pthread_mutex_unlock(&ft->ft_mtx);
+    
+    syslog(LOG_INFO, "flight: led %ju coalesced %ju abandoned %ju "
+        "full %ju", (uintmax_t)led, (uintmax_t)coalesced, 
+        (uintmax_t)abandoned, (uintmax_t)full);
+}
+
+/*
+ * The mutex is left inconsistent, if its owner exited. 
+ * Slots left behind by an exited child time out.
+ */
+static int
+sod_flight_lock(struct sod_flight_tab *ft)
+{
+    int error;
+    
+    if ((error = pthread_mutex_lock(&ft->ft_mtx)) == EOWNERDEAD) 
+        error = pthread_mutex_consistent(&ft->ft_mtx);
+    
+    return (error);
+}
+
+/*
+ * Pass result to waiters, if any, or free slot. 
+ */
+static void
+sod_flight_release(struct sod_flight_tab *ft, struct sod_flight_slot *fs, 
+        int pam_err)
+{
+    
+    if (pam_err == PAM_SUCCESS || pam_err == PAM_AUTH_ERR) {
+        fs->fs_err = pam_err;
+        fs->fs_state = (fs->fs_waiters > 0) ? 
+            SOD_FLIGHT_DONE : SOD_FLIGHT_FREE;
+    } else {
+        if (fs->fs_waiters > 0)
+            ft->ft_abandoned += 1;
+        
+        fs->fs_gen += 1;
+        fs->fs_state = SOD_FLIGHT_FREE;
+    }
+    
+    if (fs->fs_waiters > 0)
+        (void)pthread_cond_broadcast(&ft->ft_cv);
+}
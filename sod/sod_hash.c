@@ -0,0 +1,105 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sod.h>
+
+#include "sod_var.h"
+
+/*
+ * SipHash-2-4, keyed hash function by Aumasson and Bernstein.
+ */
+
+#define SOD_ROTL(x, b)     (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SOD_SIPROUND do {                                       \
+    v0 += v1; v1 = SOD_ROTL(v1, 13); v1 ^= v0;                  \
+    v0 = SOD_ROTL(v0, 32);                                      \
+    v2 += v3; v3 = SOD_ROTL(v3, 16); v3 ^= v2;                  \
+    v0 += v3; v3 = SOD_ROTL(v3, 21); v3 ^= v0;                  \
+    v2 += v1; v1 = SOD_ROTL(v1, 17); v1 ^= v2;                  \
+    v2 = SOD_ROTL(v2, 32);                                      \
+} while (0)
+
+static uint64_t
+sod_le64(const uint8_t *p)
+{
+    
+    return ((uint64_t)p[0] | (uint64_t)p[1] << 8 | 
+        (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 | 
+        (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | 
+        (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+uint64_t
+sod_siphash(const uint8_t *key, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t k0, k1, v0, v1, v2, v3, m, b;
+    uint8_t t[8];
+    size_t i, n;
+    
+    k0 = sod_le64(key);
+    k1 = sod_le64(key + 8);
+    
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+    
+    b = (uint64_t)len << 56;
+    
+    for (n = len & ~(size_t)7, i = 0; i < n; i += 8) {
+        m = sod_le64(p + i);
+        
+        v3 ^= m;
+        SOD_SIPROUND;
+        SOD_SIPROUND;
+        v0 ^= m;
+    }
+    (void)memset(t, 0, sizeof(t));
+    (void)memcpy(t, p + n, len - n);
+    
+    m = b | sod_le64(t);
+    
+    v3 ^= m;
+    SOD_SIPROUND;
+    SOD_SIPROUND;
+    v0 ^= m;
+    
+    v2 ^= 0xff;
+    SOD_SIPROUND;
+    SOD_SIPROUND;
+    SOD_SIPROUND;
+    SOD_SIPROUND;
+    
+    return (v0 ^ v1 ^ v2 ^ v3);
+}
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#ifndef _SOD_REC_H_
+#define    _SOD_REC_H_
+
+#include <stdint.h>
+
+/*
+ * Records written by sod(8), read by sod_test(1) or external 
+ * tools. Private to this tree, thus not installed by libsod.
+ */
+
+/*
+ * Capture of transactions, see -c option of sod(8). The file
+ * starts with a header, followed by records in order of time. 
+ * Tokens are not recorded, but replaced by their class, where a 
+ * response to a prompt is denoted by its ordinal among distinct 
+ * responses of the transaction, thus a repeated one, e. g. the 
+ * new password retyped, is recognized on replay. Records 
+ * of any instance appending to the same file are denoted by its 
+ * randomly chosen instance, because transactions are numbered 
+ * and usernames are hashed per instance.
+ */
+#define SOD_CAP_MAGIC     0x43444f53     /* "SODC" */
+#define SOD_CAP_VERSION     3
+
+struct sod_cap_hdr {
+    uint32_t     ch_magic;
+    uint32_t     ch_version;
+};
+
+struct sod_cap_rec {
+    uint64_t     cr_time;     /* monotonic, usec */
+    uint32_t     cr_inst;     /* denotes instance of sod(8) */
+    uint32_t     cr_txn;     /* denotes transaction of instance */
+    uint32_t     cr_user;     /* keyed hash of username */
+    int32_t     cr_code;
+    uint16_t     cr_dir;
+    uint8_t     cr_tok;
+    uint8_t     cr_ord;     /* of distinct response, 1-based, if any */
+    uint32_t     cr_seq;     /* denotes transaction of session */
+};
+
+#define SOD_CAP_IN     0x0001     /* received by sod(8) */
+#define SOD_CAP_OUT     0x0002     /* sent by sod(8) */
+
+#define SOD_CAP_TOK_NONE     0x0000
+#define SOD_CAP_TOK_USER     0x0001
+#define SOD_CAP_TOK_PROMPT     0x0002
+#define SOD_CAP_TOK_AUTHTOK     0x0003
+
+/*
+ * Audit of transactions, see -A option of sod(8). A binary 
+ * audit file starts with a header, followed by records.
+ */
+#define SOD_AUDIT_MAGIC     0x41444f53     /* "SODA" */
+#define SOD_AUDIT_VERSION     1
+
+struct sod_audit_hdr {
+    uint32_t     ah_magic;
+    uint32_t     ah_version;
+};
+
+struct sod_audit_rec {
+    uint64_t     ar_time;     /* since epoch, usec */
+    uint64_t     ar_duration;     /* usec */
+    uint32_t     ar_txn;
+    uint32_t     ar_uid;     /* of applicant */
+    int32_t     ar_class;
+    int32_t     ar_code;     /* response */
+    char     ar_user[SOD_NMAX + 1];
+};
+
+#endif /* _SOD_REC_H_ */
@@ -0,0 +1,891 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifndef __linux__
+#include <sys/ucred.h>
+#endif
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "sod_var.h"
+
+/*
+ * Scheduling of accepted connections on forked children. 
+ *
+ * An accepted connection remains pending, until its initial
+ * message has arrived. The message is inspected by MSG_PEEK,
+ * thus it is still received by the performing child. By its 
+ * code, the connection is enqueued on its class and dispatched 
+ * as long as the concurrency budget of its class is not exhausted.
+ * Authentication is dispatched in favour of password changes and 
+ * password changes on the same account are serialized. Sessions 
+ * by shared memory, see sod_ring_accept(3), hold their child for 
+ * several transactions, thus those are budgeted separately.
+ *
+ * Within its class, connections are queued by uid of applicant, 
+ * see getsockopt(2) on unix(4) sockets. Those queues are served 
+ * by deficit round robin, where each round the deficit of an 
+ * applicant is increased by its weight and any dispatched request 
+ * costs one. Thus an applicant flooding the socket delays its own 
+ * requests, but not those of others. 
+ */
+
+struct sod_class     sod_classes[SOD_CLASS_MAX] = {
+    [SOD_CLASS_AUTH] = {
+        .sk_name = "auth",
+        .sk_max = SOD_AUTH_MAX_DFLT,
+    },
+    [SOD_CLASS_PASSWD] = {
+        .sk_name = "passwd",
+        .sk_max = SOD_PASSWD_MAX_DFLT,
+    },
+    [SOD_CLASS_RING] = {
+        .sk_name = "ring",
+        .sk_max = SOD_RING_MAX_DFLT,
+    },
+};
+
+static struct sod_peer_list     sod_peers = 
+    TAILQ_HEAD_INITIALIZER(sod_peers);
+
+/*
+ * Number of pending or queued connections by uid of applicant. 
+ * Those are bounded, thus a single applicant cannot exhaust the
+ * descriptors of the parent by idle connections.
+ */
+struct sod_backlog {
+    LIST_ENTRY(sod_backlog)     bl_next;
+    uid_t     bl_uid;
+    int     bl_count;
+};
+LIST_HEAD(sod_backlog_list, sod_backlog);
+
+#define SOD_BACKLOG_HASH     64
+
+static struct sod_backlog_list     sod_backlogs[SOD_BACKLOG_HASH];
+
+int     sod_backlog_max = SOD_BACKLOG_DFLT;
+
+static uint64_t     sod_backlog_rejected;
+
+static struct sod_req_list     sod_pending;
+static struct sod_req_list     sod_running;
+
+static size_t     sod_npending;
+static size_t     sod_npartial;
+static uint32_t     sod_txn;
+
+static struct pollfd     *sod_pfd;
+static size_t     sod_pfd_len;
+
+static int     sod_sched_cred(struct sod_req *);
+static int     sod_sched_hold(struct sod_req *);
+static void     sod_sched_release(struct sod_req *);
+static void     sod_sched_enqueue(struct sod_req *);
+static void     sod_sched_requeue(struct sod_req *);
+static struct sod_flow *    sod_sched_flow(struct sod_class *, 
+    struct sod_req *);
+static void     sod_sched_free(struct sod_req *);
+static struct sod_req *     sod_sched_select(struct sod_class *);
+static struct sod_req *     sod_sched_eligible(struct sod_flow *);
+static void     sod_sched_done(struct sod_req *);
+static int     sod_sched_start(struct sod_req *);
+
+/*
+ * Monotonic clock, in microseconds.
+ */
+uint64_t
+sod_clock(void)
+{
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return (0);
+    
+    return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+void
+sod_sched_init(void)
+{
+    int i;
+    
+    TAILQ_INIT(&sod_pending);
+    TAILQ_INIT(&sod_running);
+    
+    for (i = 0; i < SOD_BACKLOG_HASH; i++)
+        LIST_INIT(&sod_backlogs[i]);
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) 
+        TAILQ_INIT(&sod_classes[i].sk_flows);
+}
+
+/*
+ * Specify weight and concurrency limit of an applicant 
+ * by argument of form user[:weight[:max]].
+ */
+int
+sod_sched_peer(const char *arg)
+{
+    struct sod_peer *pr;
+    struct passwd *pwd;
+    char buf[SOD_NMAX + 1], *s, *ep, *w, *m;
+    long val;
+    
+    if (strlen(arg) > SOD_NMAX)
+        return (-1);
+    
+    (void)strncpy(buf, arg, SOD_NMAX);
+    buf[SOD_NMAX] = '\0';
+    
+    s = buf;
+    
+    if ((w = strchr(s, ':')) != NULL) 
+        *w++ = '\0';
+    
+    if (w != NULL && (m = strchr(w, ':')) != NULL)
+        *m++ = '\0';
+    else
+        m = NULL;
+    
+    if ((pr = calloc(1, sizeof(*pr))) == NULL)
+        return (-1);
+    
+    pr->pr_weight = SOD_WEIGHT_DFLT;
+    
+    val = strtol(s, &ep, 10);
+    
+    if (*s != '\0' && *ep == '\0' && val >= 0 
+        && (unsigned long)val <= UINT_MAX) 
+        pr->pr_uid = (uid_t)val;
+    else if ((pwd = getpwnam(s)) != NULL)
+        pr->pr_uid = pwd->pw_uid;
+    else 
+        goto bad;
+    
+    if (w != NULL) {
+        val = strtol(w, &ep, 10);
+        
+        if (*w == '\0' || *ep != '\0' || val < 1 || val > INT_MAX)
+            goto bad;
+        
+        pr->pr_weight = (int)val;
+    }
+    
+    if (m != NULL) {
+        val = strtol(m, &ep, 10);
+        
+        if (*m == '\0' || *ep != '\0' || val < 0 || val > INT_MAX)
+            goto bad;
+        
+        pr->pr_max = (int)val;
+    }
+    TAILQ_INSERT_TAIL(&sod_peers, pr, pr_next);
+    
+    return (0);
+bad:
+    free(pr);
+    return (-1);
+}
+
+/*
+ * Accepted connection awaits its initial message.
+ */
+int
+sod_sched_enter(int fd)
+{
+    struct sod_req *sr;
+    
+    if ((sr = calloc(1, sizeof(*sr))) == NULL) 
+        return (-1);
+    
+    sr->sr_fd = fd;
+    sr->sr_txn = ++sod_txn;
+    sr->sr_class = -1;
+    sr->sr_shard = -1;
+    sr->sr_t0 = sod_clock();
+    
+    if (sod_sched_cred(sr) < 0 || sod_sched_hold(sr) < 0) {
+        sod_sched_free(sr);
+        return (-1);
+    }
+    TAILQ_INSERT_TAIL(&sod_pending, sr, sr_next);
+    sod_npending += 1;
+    
+    return (0);
+}
+
+/*
+ * Returns poll(2) set, where by caller used entries precede 
+ * those denoting shards, if any, and pending connections.
+ */
+struct pollfd *
+sod_sched_pollset(size_t nfixed, size_t *nfds)
+{
+    struct pollfd *pfd;
+    struct sod_req *sr;
+    size_t n;
+    
+    n = nfixed + (size_t)sod_shard_count() + sod_npending;
+    
+    if (n > sod_pfd_len) {
+        if ((pfd = realloc(sod_pfd, n * sizeof(*pfd))) == NULL)
+            return (NULL);
+        
+        sod_pfd = pfd;
+        sod_pfd_len = n;
+    }
+    pfd = sod_pfd + nfixed;
+    
+    sod_shard_pollset(pfd);
+    pfd += sod_shard_count();
+    
+/*
+ * Readiness persists on incomplete messages, thus those 
+ * are revisited by timeout, see sod_sched_timo().
+ */    
+    TAILQ_FOREACH(sr, &sod_pending, sr_next) {
+        pfd->fd = sr->sr_fd;
+        pfd->events = (sr->sr_partial != 0) ? 0 : POLLIN;
+        pfd->revents = 0;
+        pfd++;
+    }
+    *nfds = n;
+    
+    return (sod_pfd);
+}
+
+/*
+ * Classify pending connections, if their initial message 
+ * has arrived, otherwise release them on EOF or timeout. 
+ * The poll(2) set must not be altered since its creation.
+ */
+void
+sod_sched_input(struct pollfd *pfd, size_t n)
+{
+    struct sod_req *sr, *next;
+    struct sod_msg msg;
+    uint64_t now;
+    ssize_t len;
+    size_t i;
+    
+    sod_shard_input(pfd);
+    
+    pfd += sod_shard_count();
+    n -= (size_t)sod_shard_count();
+    
+    now = sod_clock();
+    
+    for (sr = TAILQ_FIRST(&sod_pending), i = 0; 
+        sr != NULL && i < n; sr = next, i++) {
+        next = TAILQ_NEXT(sr, sr_next);
+        
+/*
+ * Released on timeout, even if its message is incomplete.
+ */        
+        if (now - sr->sr_t0 >= (uint64_t)SOD_REQ_TIMO * 1000000) 
+            len = 0;
+        else if (pfd[i].revents == 0 && sr->sr_partial == 0) 
+            continue;
+        else {
+            len = recv(sr->sr_fd, &msg, sizeof(msg), 
+                MSG_PEEK|MSG_DONTWAIT);
+        
+            if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+/*
+ * Incomplete message, await remainder unless closed by applicant.
+ */        
+            if (len > 0 && (size_t)len < sizeof(msg)) {
+                if ((pfd[i].revents & (POLLHUP|POLLERR)) != 0)
+                    len = 0;
+                else {
+                    if (sr->sr_partial == 0)
+                        sod_npartial += 1;
+                    
+                    sr->sr_partial = 1;
+                    continue;
+                }
+            }
+        }
+        TAILQ_REMOVE(&sod_pending, sr, sr_next);
+        sod_npending -= 1;
+        
+        if (sr->sr_partial != 0) {
+            sod_npartial -= 1;
+            sr->sr_partial = 0;
+        }
+        
+        if (len <= 0) {
+            (void)close(sr->sr_fd);
+            sod_sched_free(sr);
+            continue;
+        }
+/*
+ * Unknown requests are rejected by SOD_AUTH_REJ, 
+ * thus those are performed as authentication.
+ */        
+        if (msg.sm_code == SOD_PASSWD_REQ)
+            sr->sr_class = SOD_CLASS_PASSWD;
+        else if (msg.sm_code == SOD_RING_REQ)
+            sr->sr_class = SOD_CLASS_RING;
+        else
+            sr->sr_class = SOD_CLASS_AUTH;
+        
+        (void)strncpy(sr->sr_user, msg.sm_tok, SOD_NMAX);
+        sr->sr_user[SOD_NMAX] = '\0';
+        (void)memset(&msg, 0, sizeof(msg));
+        
+        sr->sr_t0 = now;
+        
+        sod_sched_enqueue(sr);
+    }
+}
+
+/*
+ * Dispatch queued connections by priority of their class.
+ */
+void
+sod_sched_dispatch(void)
+{
+    struct sod_class *sk;
+    struct sod_req *sr;
+    uint64_t now, dt;
+    int i;
+    
+    now = sod_clock();
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) {
+        sk = &sod_classes[i];
+        
+        while (sk->sk_running < sk->sk_max) {
+            if ((sr = sod_sched_select(sk)) == NULL)
+                break;
+            sk->sk_qlen -= 1;
+/*
+ * Retried on next iteration, if failed.
+ */            
+            if (sod_sched_start(sr) < 0) {
+                sod_sched_requeue(sr);
+                return;
+            }
+/*
+ * Parent does not need an open file descriptor 
+ * denotes accepted connection, because child
+ * performs pam(8) transaction on iherited once.
+ */                
+            (void)close(sr->sr_fd);
+            sr->sr_fd = -1;
+            
+            sod_sched_release(sr);
+            
+            TAILQ_INSERT_TAIL(&sod_running, sr, sr_next);
+            sk->sk_running += 1;
+            
+            if (sr->sr_pr != NULL)
+                sr->sr_pr->pr_running += 1;
+            
+            dt = now - sr->sr_t0;
+            
+            sk->sk_dispatched += 1;
+            sk->sk_wait += dt;
+            
+            if (dt > sk->sk_wait_max)
+                sk->sk_wait_max = dt;
+        }
+    }
+}
+
+/*
+ * Release terminated children and their budget.
+ */
+void
+sod_sched_reap(void)
+{
+    struct sod_req *sr;
+    pid_t cpid;
+    
+    while ((cpid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        TAILQ_FOREACH(sr, &sod_running, sr_next) {
+            if (sr->sr_pid == cpid)
+                break;
+        }
+        
+        if (sr != NULL)
+            sod_sched_done(sr);
+    }
+}
+
+/*
+ * Transaction was completed by shard.
+ */
+void
+sod_sched_complete(uint32_t txn)
+{
+    struct sod_req *sr;
+    
+    TAILQ_FOREACH(sr, &sod_running, sr_next) {
+        if (sr->sr_shard > -1 && sr->sr_txn == txn)
+            break;
+    }
+    
+    if (sr != NULL)
+        sod_sched_done(sr);
+}
+
+/*
+ * Shard has terminated, release budget of its transactions.
+ */
+void
+sod_sched_lost(int shard)
+{
+    struct sod_req *sr, *next;
+    
+    for (sr = TAILQ_FIRST(&sod_running); sr != NULL; sr = next) {
+        next = TAILQ_NEXT(sr, sr_next);
+        
+        if (sr->sr_shard == shard)
+            sod_sched_done(sr);
+    }
+}
+
+/*
+ * Prohibit access on file descriptors denoting 
+ * connections, which are not yet dispatched.
+ */
+void
+sod_sched_closeall(void)
+{
+    struct sod_flow *fl;
+    struct sod_req *sr;
+    int i;
+    
+    TAILQ_FOREACH(sr, &sod_pending, sr_next) 
+        (void)close(sr->sr_fd);
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) {
+        TAILQ_FOREACH(fl, &sod_classes[i].sk_flows, fl_next) {
+            TAILQ_FOREACH(sr, &fl->fl_queue, sr_next) 
+                (void)close(sr->sr_fd);
+        }
+    }
+}
+
+/*
+ * Returns timeout for poll(2) in milliseconds. Pending 
+ * or queued connections are revisited periodically.
+ */
+int
+sod_sched_timo(int idle)
+{
+    int i, timo;
+    
+    timo = (idle > 0) ? idle * 1000 : INFTIM;
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) {
+        if (sod_classes[i].sk_qlen > 0)
+            break;
+    }
+    
+    if (sod_npending > 0 || i < SOD_CLASS_MAX) {
+        if (timo == INFTIM || timo > 1000)
+            timo = 1000;
+    }
+    
+    if (sod_npartial > 0 && timo > SOD_REQ_PARTIAL_IVL)
+        timo = SOD_REQ_PARTIAL_IVL;
+    
+    return (timo);
+}
+
+/*
+ * Returns 0, if no connection is in progress.
+ */
+int
+sod_sched_busy(void)
+{
+    int i;
+    
+    if (sod_npending > 0 || TAILQ_EMPTY(&sod_running) == 0)
+        return (1);
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) {
+        if (sod_classes[i].sk_qlen > 0)
+            return (1);
+    }
+    return (0);
+}
+
+/*
+ * Report queue depth and wait time by syslog(3).
+ */
+void
+sod_sched_stats(void)
+{
+    struct sod_class *sk;
+    struct sod_peer *pr;
+    int i;
+    
+    syslog(LOG_INFO, "pending: %zu backlog %d rejected %ju", sod_npending, 
+        sod_backlog_max, (uintmax_t)sod_backlog_rejected);
+    
+    for (i = 0; i < SOD_CLASS_MAX; i++) {
+        sk = &sod_classes[i];
+        
+        syslog(LOG_INFO, "%s: running %d/%d queued %d applicants %d "
+            "dispatched %ju wait avg %ju usec max %ju usec", sk->sk_name, 
+            sk->sk_running, sk->sk_max, sk->sk_qlen, sk->sk_nflows,
+            (uintmax_t)sk->sk_dispatched, 
+            (uintmax_t)((sk->sk_dispatched > 0) ? 
+                sk->sk_wait / sk->sk_dispatched : 0), 
+            (uintmax_t)sk->sk_wait_max);
+    }
+    
+    TAILQ_FOREACH(pr, &sod_peers, pr_next) {
+        syslog(LOG_INFO, "uid %ju: weight %d running %d/%d", 
+            (uintmax_t)pr->pr_uid, pr->pr_weight, pr->pr_running, 
+            pr->pr_max);
+    }
+    sod_shard_stats();
+}
+
+/*
+ * Fetch credentials of applicant.
+ */
+static int
+sod_sched_cred(struct sod_req *sr)
+{
+#ifdef __linux__
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+    
+    if (getsockopt(sr->sr_fd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0)
+        return (-1);
+    
+    sr->sr_uid = uc.uid;
+    sr->sr_peer = uc.pid;
+#else
+    struct xucred xuc;
+    socklen_t len = sizeof(xuc);
+    
+    if (getsockopt(sr->sr_fd, SOL_LOCAL, LOCAL_PEERCRED, &xuc, &len) < 0)
+        return (-1);
+    
+    if (xuc.cr_version != XUCRED_VERSION)
+        return (-1);
+    
+    sr->sr_uid = xuc.cr_uid;
+#ifdef cr_pid
+    sr->sr_peer = xuc.cr_pid;
+#else
+    sr->sr_peer = -1;
+#endif
+#endif /* __linux__ */
+    TAILQ_FOREACH(sr->sr_pr, &sod_peers, pr_next) {
+        if (sr->sr_pr->pr_uid == sr->sr_uid)
+            break;
+    }
+    return (0);
+}
+
+/*
+ * Account connection on backlog of its applicant. Fails, 
+ * if the backlog is exhausted.
+ */
+static int
+sod_sched_hold(struct sod_req *sr)
+{
+    struct sod_backlog_list *bh;
+    struct sod_backlog *bl;
+    
+    if (sod_backlog_max == 0)
+        return (0);
+    
+    bh = &sod_backlogs[sr->sr_uid % SOD_BACKLOG_HASH];
+    
+    LIST_FOREACH(bl, bh, bl_next) {
+        if (bl->bl_uid == sr->sr_uid)
+            break;
+    }
+    
+    if (bl == NULL) {
+        if ((bl = calloc(1, sizeof(*bl))) == NULL)
+            return (-1);
+        
+        bl->bl_uid = sr->sr_uid;
+        LIST_INSERT_HEAD(bh, bl, bl_next);
+    } else if (bl->bl_count >= sod_backlog_max) {
+        sod_backlog_rejected += 1;
+        return (-1);
+    }
+    bl->bl_count += 1;
+    sr->sr_backlog = 1;
+    
+    return (0);
+}
+
+/*
+ * Connection was dispatched or released.
+ */
+static void
+sod_sched_release(struct sod_req *sr)
+{
+    struct sod_backlog *bl;
+    
+    if (sr->sr_backlog == 0)
+        return;
+    
+    LIST_FOREACH(bl, &sod_backlogs[sr->sr_uid % SOD_BACKLOG_HASH], 
+        bl_next) {
+        if (bl->bl_uid == sr->sr_uid)
+            break;
+    }
+    
+    if (bl != NULL && --bl->bl_count == 0) {
+        LIST_REMOVE(bl, bl_next);
+        free(bl);
+    }
+    sr->sr_backlog = 0;
+}
+
+/*
+ * Enqueue classified connection on queue of its applicant.
+ */
+static void
+sod_sched_enqueue(struct sod_req *sr)
+{
+    struct sod_class *sk;
+    struct sod_flow *fl;
+    
+    sk = &sod_classes[sr->sr_class];
+    
+    if ((fl = sod_sched_flow(sk, sr)) == NULL) {
+        (void)close(sr->sr_fd);
+        sod_sched_free(sr);
+        return;
+    }
+    TAILQ_INSERT_TAIL(&fl->fl_queue, sr, sr_next);
+    sk->sk_qlen += 1;
+}
+
+/*
+ * Return connection, which failed to dispatch, in front of 
+ * queue of its applicant and refund deficit charged by 
+ * sod_sched_select(), thus it is retried first. 
+ */
+static void
+sod_sched_requeue(struct sod_req *sr)
+{
+    struct sod_class *sk;
+    struct sod_flow *fl;
+    
+    sk = &sod_classes[sr->sr_class];
+    
+    if ((fl = sod_sched_flow(sk, sr)) == NULL) {
+        (void)close(sr->sr_fd);
+        sod_sched_free(sr);
+        return;
+    }
+    TAILQ_REMOVE(&sk->sk_flows, fl, fl_next);
+    TAILQ_INSERT_HEAD(&sk->sk_flows, fl, fl_next);
+    
+    TAILQ_INSERT_HEAD(&fl->fl_queue, sr, sr_next);
+    fl->fl_deficit += 1;
+    sk->sk_qlen += 1;
+}
+
+/*
+ * Lookup queue of applicant, created if not found.
+ */
+static struct sod_flow *
+sod_sched_flow(struct sod_class *sk, struct sod_req *sr)
+{
+    struct sod_flow *fl;
+    
+    TAILQ_FOREACH(fl, &sk->sk_flows, fl_next) {
+        if (fl->fl_uid == sr->sr_uid)
+            return (fl);
+    }
+    
+    if ((fl = calloc(1, sizeof(*fl))) == NULL) 
+        return (NULL);
+        
+    fl->fl_uid = sr->sr_uid;
+    fl->fl_pr = sr->sr_pr;
+    TAILQ_INIT(&fl->fl_queue);
+    
+    TAILQ_INSERT_TAIL(&sk->sk_flows, fl, fl_next);
+    sk->sk_nflows += 1;
+    
+    return (fl);
+}
+
+/*
+ * Release budget of completed transaction.
+ */
+static void
+sod_sched_done(struct sod_req *sr)
+{
+    
+    TAILQ_REMOVE(&sod_running, sr, sr_next);
+    sod_classes[sr->sr_class].sk_running -= 1;
+        
+    if (sr->sr_pr != NULL)
+        sr->sr_pr->pr_running -= 1;
+        
+    sod_sched_free(sr);
+}
+
+static void
+sod_sched_free(struct sod_req *sr)
+{
+    
+    sod_sched_release(sr);
+    
+    (void)memset(sr, 0, sizeof(*sr));
+    free(sr);
+}
+
+/*
+ * Dequeue next connection by deficit round robin. Returns 
+ * NULL, if no applicant has a connection eligible for dispatch. 
+ */
+static struct sod_req *
+sod_sched_select(struct sod_class *sk)
+{
+    struct sod_flow *fl;
+    struct sod_req *sr;
+    int i, n;
+    
+    n = sk->sk_nflows;
+    
+    for (i = 0; i < n; i++) {
+        fl = TAILQ_FIRST(&sk->sk_flows);
+/*
+ * Round of applicant starts.
+ */        
+        if (fl->fl_deficit < 1) 
+            fl->fl_deficit += (fl->fl_pr != NULL) ? 
+                fl->fl_pr->pr_weight : SOD_WEIGHT_DFLT;
+        
+        if ((sr = sod_sched_eligible(fl)) != NULL) {
+            TAILQ_REMOVE(&fl->fl_queue, sr, sr_next);
+            fl->fl_deficit -= 1;
+            
+            if (TAILQ_EMPTY(&fl->fl_queue)) {
+                TAILQ_REMOVE(&sk->sk_flows, fl, fl_next);
+                sk->sk_nflows -= 1;
+                free(fl);
+            } else if (fl->fl_deficit < 1) {
+                TAILQ_REMOVE(&sk->sk_flows, fl, fl_next);
+                TAILQ_INSERT_TAIL(&sk->sk_flows, fl, fl_next);
+            }
+            return (sr);
+        }
+/*
+ * Blocked applicants do not accumulate deficit.
+ */        
+        fl->fl_deficit = 0;
+        
+        TAILQ_REMOVE(&sk->sk_flows, fl, fl_next);
+        TAILQ_INSERT_TAIL(&sk->sk_flows, fl, fl_next);
+    }
+    return (NULL);
+}
+
+/*
+ * Returns first queued connection of applicant, eligible 
+ * for dispatch, if its concurrency limit is not exhausted. 
+ * Password changes on an account are not performed 
+ * concurrently, because those would contend on locks of 
+ * the password database. 
+ */
+static struct sod_req *
+sod_sched_eligible(struct sod_flow *fl)
+{
+    struct sod_req *sr, *rr;
+    
+    if (fl->fl_pr != NULL && fl->fl_pr->pr_max > 0 
+        && fl->fl_pr->pr_running >= fl->fl_pr->pr_max)
+        return (NULL);
+    
+    TAILQ_FOREACH(sr, &fl->fl_queue, sr_next) {
+        if (sr->sr_class != SOD_CLASS_PASSWD)
+            break;
+        
+        TAILQ_FOREACH(rr, &sod_running, sr_next) {
+            if (rr->sr_class == SOD_CLASS_PASSWD 
+                && strcmp(rr->sr_user, sr->sr_user) == 0)
+                break;
+        }
+        
+        if (rr == NULL)
+            break;
+    }
+    return (sr);
+}
+
+/*
+ * Pass connection to shard or fork child, 
+ * performing pam(8) transaction.
+ */
+static int
+sod_sched_start(struct sod_req *sr)
+{
+    
+    if (sod_shard_count() > 0) 
+        return (sod_shard_dispatch(sr));
+    
+    if ((sr->sr_pid = fork()) != 0)
+        return ((sr->sr_pid < 0) ? -1 : 0);
+/*
+ * Prohibit access by child on file descriptors
+ * denoting connections of other applicants. 
+ */    
+    sod_sched_closeall();
+    sod_detach();
+/*
+ * Perform pam(8) transaction.
+ */
+    sod_doit(sr);
+    exit(EX_OK);
+}
@@ -0,0 +1,518 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#ifndef __linux__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "sod_var.h"
+
+/*
+ * Sharded execution, see -n option.
+ *
+ * Any shard is a process pinned on a CPU, forking children
+ * which perform by parent dispatched connections. Children
+ * inherit the affinity of their shard, thus hashing is not 
+ * migrated between CPUs. Memory is not bound explicitly, thus 
+ * locality relies on first-touch: pages of a child are allocated 
+ * local to the NUMA domain of its CPU, whereas pages inherited from 
+ * the parent, e. g. shared memory, are not. Only the parent 
+ * accepts connections and passes them to the least loaded 
+ * shard by SCM_RIGHTS. Thus any shard has its own queue, 
+ * its control socket, and is not woken by connections 
+ * performed by other shards.
+ */
+
+struct sod_shard {
+    pid_t     sh_pid;
+    int     sh_fd;     /* control socket, parent side */
+    int     sh_cpu;
+    int     sh_load;     /* dispatched, but not completed */
+    uint64_t     sh_dispatched;
+};
+
+/*
+ * By parent to shard passed connection.
+ */
+struct sod_shard_msg {
+    struct sod_req     sm_req;
+    struct sod_conf     sm_conf;
+};
+
+static struct sod_shard     *sod_shards;
+static int     sod_nshards;
+
+static int     sod_shard_sig[2] = { -1, -1 };
+
+static int     sod_shard_spawn(int);
+static void     sod_shard_main(struct sod_shard *, int);
+static int     sod_shard_cpus(int *, int);
+static void     sod_shard_pin(int);
+static void     sod_shard_sigchld(int);
+
+/*
+ * Fork shards, pinned in round robin on CPUs, where the 
+ * parent may run. Those are not necessarily the online 
+ * CPUs, if restricted by cpuset(1) or taskset(1).
+ */
+int
+sod_shard_init(int n)
+{
+    int cpus[SOD_SHARD_MAX];
+    int i, ncpu;
+    
+    if ((sod_shards = calloc((size_t)n, sizeof(*sod_shards))) == NULL)
+        return (-1);
+    
+    if ((ncpu = sod_shard_cpus(cpus, SOD_SHARD_MAX)) < 1)
+        syslog(LOG_ERR, "Can't fetch CPU affinity, shards are not pinned");
+    
+    for (i = 0; i < n; i++) {
+        sod_shards[i].sh_fd = -1;
+        sod_shards[i].sh_cpu = (ncpu > 0) ? cpus[i % ncpu] : -1;
+    }
+    sod_nshards = n;
+    
+    for (i = 0; i < n; i++) {
+        if (sod_shard_spawn(i) < 0)
+            return (-1);
+    }
+    return (0);
+}
+
+int
+sod_shard_count(void)
+{
+    
+    return (sod_nshards);
+}
+
+/*
+ * Pass connection to least loaded shard. 
+ */
+int
+sod_shard_dispatch(struct sod_req *sr)
+{
+    struct sod_shard_msg msg;
+    struct sod_shard *sh;
+    struct msghdr mh;
+    struct cmsghdr *cmh;
+    struct iovec iov;
+    union {
+        struct cmsghdr     cm;
+        char     buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    int i;
+    
+    for (sh = NULL, i = 0; i < sod_nshards; i++) {
+        if (sod_shards[i].sh_fd < 0)
+            continue;
+        
+        if (sh == NULL || sod_shards[i].sh_load < sh->sh_load)
+            sh = &sod_shards[i];
+    }
+    
+    if (sh == NULL)
+        return (-1);
+    
+    (void)memset(&msg, 0, sizeof(msg));
+    msg.sm_req = *sr;
+    msg.sm_conf = sod_cf;
+    
+    (void)memset(&cbuf, 0, sizeof(cbuf));
+    (void)memset(&mh, 0, sizeof(mh));
+    
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    
+    cmh = CMSG_FIRSTHDR(&mh);
+    cmh->cmsg_level = SOL_SOCKET;
+    cmh->cmsg_type = SCM_RIGHTS;
+    cmh->cmsg_len = CMSG_LEN(sizeof(int));
+    (void)memcpy(CMSG_DATA(cmh), &sr->sr_fd, sizeof(int));
+/*
+ * Retried later, if queue of shard is exhausted.
+ */    
+    if (sendmsg(sh->sh_fd, &mh, MSG_DONTWAIT) < 0) 
+        return (-1);
+    
+    (void)memset(&msg, 0, sizeof(msg));
+    
+    sr->sr_shard = (int)(sh - sod_shards);
+    sr->sr_pid = 0;
+    
+    sh->sh_load += 1;
+    sh->sh_dispatched += 1;
+    
+    return (0);
+}
+
+void
+sod_shard_pollset(struct pollfd *pfd)
+{
+    int i;
+    
+    for (i = 0; i < sod_nshards; i++) {
+        pfd[i].fd = sod_shards[i].sh_fd;
+        pfd[i].events = POLLIN;
+        pfd[i].revents = 0;
+    }
+}
+
+/*
+ * Release completed transactions. A terminated 
+ * shard is replaced.
+ */
+void
+sod_shard_input(struct pollfd *pfd)
+{
+    struct sod_shard *sh;
+    uint32_t txn;
+    ssize_t n;
+    int i;
+    
+    for (i = 0; i < sod_nshards; i++) {
+        if (pfd[i].revents == 0)
+            continue;
+        
+        sh = &sod_shards[i];
+        
+        while ((n = recv(sh->sh_fd, &txn, sizeof(txn), 
+            MSG_DONTWAIT)) == sizeof(txn)) {
+            sh->sh_load -= 1;
+            sod_sched_complete(txn);
+        }
+        
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        
+        syslog(LOG_ERR, "Shard on CPU %d terminated", sh->sh_cpu);
+        
+        (void)close(sh->sh_fd);
+        sh->sh_fd = -1;
+        sh->sh_load = 0;
+        
+        sod_sched_lost(i);
+        
+        (void)sod_shard_spawn(i);
+    }
+}
+
+void
+sod_shard_stats(void)
+{
+    int i;
+    
+    for (i = 0; i < sod_nshards; i++) {
+        syslog(LOG_INFO, "shard %d: cpu %d running %d dispatched %ju", 
+            i, sod_shards[i].sh_cpu, sod_shards[i].sh_load, 
+            (uintmax_t)sod_shards[i].sh_dispatched);
+    }
+}
+
+static int
+sod_shard_spawn(int i)
+{
+    struct sod_shard *sh;
+    int sv[2], j;
+    
+    sh = &sod_shards[i];
+    
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0) {
+        syslog(LOG_ERR, "Can't create control socket of shard");
+        return (-1);
+    }
+    
+    if ((sh->sh_pid = fork()) < 0) {
+        syslog(LOG_ERR, "Can't fork shard");
+        (void)close(sv[0]);
+        (void)close(sv[1]);
+        return (-1);
+    }
+    
+    if (sh->sh_pid == 0) {
+        (void)close(sv[0]);
+        
+        for (j = 0; j < sod_nshards; j++) {
+            if (sod_shards[j].sh_fd > -1)
+                (void)close(sod_shards[j].sh_fd);
+        }
+        sod_sched_closeall();
+        sod_detach();
+        
+        sod_shard_main(sh, sv[1]);
+        exit(EX_OK);
+    }
+    (void)close(sv[1]);
+    
+    sh->sh_fd = sv[0];
+    
+    return (0);
+}
+
+/*
+ * Main loop of shard.
+ */
+static void
+sod_shard_main(struct sod_shard *sh, int s)
+{
+    struct sod_req_list workers;
+    struct sod_shard_msg msg;
+    struct sod_req *sr;
+    struct sigaction sa;
+    struct pollfd pfd[2];
+    struct msghdr mh;
+    struct cmsghdr *cmh;
+    struct iovec iov;
+    union {
+        struct cmsghdr     cm;
+        char     buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    sigset_t sigset;
+    char c;
+    pid_t cpid;
+    ssize_t n;
+    
+    TAILQ_INIT(&workers);
+    
+    sod_shard_pin(sh->sh_cpu);
+/*
+ * Children are reaped on SIGCHLD, see sod_shard_sigchld().
+ */    
+    if (pipe2(sod_shard_sig, O_CLOEXEC|O_NONBLOCK) < 0) {
+        syslog(LOG_ERR, "Can't create signal channel of shard");
+        exit(EX_OSERR);
+    }
+    
+    (void)memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sod_shard_sigchld;
+    (void)sigemptyset(&sa.sa_mask);
+    
+    (void)sigemptyset(&sigset);
+    (void)sigaddset(&sigset, SIGCHLD);
+    
+    if (sigaction(SIGCHLD, &sa, NULL) < 0 
+        || pthread_sigmask(SIG_UNBLOCK, &sigset, NULL) != 0) {
+        syslog(LOG_ERR, "Can't handle SIGCHLD by shard");
+        exit(EX_OSERR);
+    }
+    
+    for (;;) {
+        pfd[0].fd = s;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = sod_shard_sig[0];
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        
+        if (poll(pfd, 2, INFTIM) < 0)
+            continue;
+/*
+ * Report completed transactions.
+ */        
+        if (pfd[1].revents & POLLIN) {
+            while (read(sod_shard_sig[0], &c, sizeof(c)) > 0)
+                continue;
+            
+            while ((cpid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                TAILQ_FOREACH(sr, &workers, sr_next) {
+                    if (sr->sr_pid == cpid)
+                        break;
+                }
+                
+                if (sr == NULL)
+                    continue;
+                
+                TAILQ_REMOVE(&workers, sr, sr_next);
+                
+                (void)send(s, &sr->sr_txn, sizeof(sr->sr_txn), 0);
+                free(sr);
+            }
+        }
+        
+        if ((pfd[0].revents & (POLLIN|POLLHUP)) == 0)
+            continue;
+        
+        (void)memset(&cbuf, 0, sizeof(cbuf));
+        (void)memset(&mh, 0, sizeof(mh));
+    
+        iov.iov_base = &msg;
+        iov.iov_len = sizeof(msg);
+    
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = cbuf.buf;
+        mh.msg_controllen = sizeof(cbuf.buf);
+        
+        if ((n = recvmsg(s, &mh, 0)) < 0 && errno == EINTR)
+            continue;
+/*
+ * Parent has terminated.
+ */        
+        if (n <= 0)
+            exit(EX_OK);
+        
+        cmh = CMSG_FIRSTHDR(&mh);
+        
+        if (n != sizeof(msg) || cmh == NULL 
+            || cmh->cmsg_level != SOL_SOCKET 
+            || cmh->cmsg_type != SCM_RIGHTS) 
+            continue;
+        
+        if ((sr = calloc(1, sizeof(*sr))) == NULL) {
+            (void)memcpy(&msg.sm_req.sr_fd, CMSG_DATA(cmh), sizeof(int));
+            (void)close(msg.sm_req.sr_fd);
+            continue;
+        }
+        *sr = msg.sm_req;
+        sr->sr_pr = NULL;
+        (void)memcpy(&sr->sr_fd, CMSG_DATA(cmh), sizeof(int));
+        
+        sod_cf = msg.sm_conf;
+        
+        if ((sr->sr_pid = fork()) == 0) {
+/*
+ * Restore signal handling, as inherited from parent.
+ */            
+            (void)signal(SIGCHLD, SIG_DFL);
+            (void)pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+            
+            (void)close(s);
+            (void)close(sod_shard_sig[0]);
+            (void)close(sod_shard_sig[1]);
+/*
+ * Perform pam(8) transaction.
+ */
+            sod_doit(sr);
+            exit(EX_OK);
+        }
+        (void)close(sr->sr_fd);
+        sr->sr_fd = -1;
+/*
+ * Report failure as completion.
+ */        
+        if (sr->sr_pid < 0) {
+            (void)send(s, &sr->sr_txn, sizeof(sr->sr_txn), 0);
+            free(sr);
+        } else
+            TAILQ_INSERT_TAIL(&workers, sr, sr_next);
+    }
+}
+
+/*
+ * Fetch at most max CPUs, on which calling process may run.
+ */
+static int
+sod_shard_cpus(int *cpus, int max)
+{
+#ifdef __linux__
+    cpu_set_t set;
+#else
+    cpuset_t set;
+#endif
+    int cpu, n;
+    
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+#else
+    if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1, 
+        sizeof(set), &set) < 0)
+#endif
+        return (-1);
+    
+    for (n = 0, cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    }
+    return (n);
+}
+
+/*
+ * Pin calling process on CPU, if any.
+ */
+static void
+sod_shard_pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    
+    if (cpu < 0)
+        return;
+    
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+#else
+    cpuset_t set;
+    
+    if (cpu < 0)
+        return;
+    
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    
+    if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1, 
+        sizeof(set), &set) < 0)
+#endif
+        syslog(LOG_ERR, "Can't pin shard on CPU %d", cpu);
+}
+
+static void
+sod_shard_sigchld(int sig __unused)
+{
+    int error = errno;
+    
+    (void)write(sod_shard_sig[1], "", 1);
+    errno = error;
+}
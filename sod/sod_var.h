@@ -0,0 +1,235 @@
+/*-
+ * Copyright (c) 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materiasc provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ * 
+ * version=0.3
+ */
+
+#ifndef _SOD_VAR_H_
+#define    _SOD_VAR_H_
+
+#include <sys/queue.h>
+
+#include <stdint.h>
+
+/*
+ * Internal interfaces of sod(8).
+ */
+
+/*
+ * By login.conf(5) derived attributes, cached by parent 
+ * and inherited by any forked child. Reloaded on SIGHUP.
+ */
+struct sod_conf {
+    char     sf_prompt[SOD_NMAX + 1];
+    char     sf_pw_prompt[SOD_NMAX + 1];
+    int     sf_retries;
+    int     sf_backoff;
+};
+
+/*
+ * Request classes, in order of priority.
+ */
+#define SOD_CLASS_AUTH     0
+#define SOD_CLASS_PASSWD     1
+#define SOD_CLASS_RING     2
+#define SOD_CLASS_MAX     3
+
+#define SOD_AUTH_MAX_DFLT     64
+#define SOD_PASSWD_MAX_DFLT     2
+#define SOD_RING_MAX_DFLT     4
+
+#define SOD_SHARD_MAX     256
+
+/*
+ * Applicants must send their initial message in time.
+ */
+#define SOD_REQ_TIMO     30
+
+/*
+ * Incomplete initial messages are polled for their remainder.
+ */
+#define SOD_REQ_PARTIAL_IVL     100     /* msec */
+
+/*
+ * Sessions by shared memory are terminated, if idle.
+ */
+#define SOD_RING_IDLE     60     /* sec */
+
+/*
+ * Distinct responses to prompts of a transaction, which 
+ * are denoted by their ordinal in capture, see sod_cap.c.
+ */
+#define SOD_CAP_TOKS     8
+
+/*
+ * By uid of applicant specified weight and concurrency 
+ * limit, see -u option. Applicants not specified are 
+ * weighted by SOD_WEIGHT_DFLT and are not limited.
+ */
+struct sod_peer {
+    TAILQ_ENTRY(sod_peer)     pr_next;
+    uid_t     pr_uid;
+    int     pr_weight;
+    int     pr_max;     /* 0, if not limited */
+    int     pr_running;
+};
+TAILQ_HEAD(sod_peer_list, sod_peer);
+
+#define SOD_WEIGHT_DFLT     1
+
+/*
+ * By default, an applicant holds at most SOD_BACKLOG_DFLT 
+ * connections, which are pending or queued, see -b option.
+ */
+#define SOD_BACKLOG_DFLT     128
+
+/*
+ * Accepted connection, either pending, queued or 
+ * performed by a forked child.
+ */
+struct sod_req {
+    TAILQ_ENTRY(sod_req)     sr_next;
+    int     sr_fd;     /* fd, socket, applicant */
+    int     sr_class;
+    pid_t     sr_pid;     /* performing child, if any */
+    int     sr_shard;     /* performing shard, if any */
+    uid_t     sr_uid;     /* credentials of applicant */
+    pid_t     sr_peer;
+    struct sod_peer     *sr_pr;
+    uint32_t     sr_txn;
+    uint64_t     sr_t0;     /* accepted, then enqueued */
+    int     sr_partial;     /* initial message incomplete */
+    int     sr_backlog;     /* accounted as pending or queued */
+    char     sr_user[SOD_NMAX + 1];
+};
+TAILQ_HEAD(sod_req_list, sod_req);
+
+/*
+ * Participation of an authentication attempt in 
+ * coalesced verification, see sod_flight.c.
+ */
+struct sod_flight_ref {
+    int     fr_slot;     /* led slot, if any, else -1 */
+    uint32_t     fr_gen;
+    int     fr_err;     /* by leader passed pam_err, else -1 */
+};
+
+/*
+ * State of transaction, performed by child.
+ */
+struct sod_softc {
+    struct sod_msg     sc_buf;     /* for transaction used buffer */
+    int     sc_rmt;     /* fd, socket, applicant */
+    const struct sod_req     *sc_sr;
+    struct sod_ring     *sc_ring;     /* if by shared memory */
+    const char     *sc_user;     /* if authentication is coalesced */
+    const char     *sc_tok;     /* keys flight or answers prompt */
+    int     sc_flight;     /* keyed by response to first prompt */
+    struct sod_flight_ref     sc_fr;
+    uint32_t     sc_seq;     /* transaction of session */
+    uint32_t     sc_cap_user;     /* keyed hash, if captured */
+    uint64_t     sc_cap_tok[SOD_CAP_TOKS];     /* distinct responses */
+    int     sc_cap_ntok;
+};
+
+/*
+ * Queued requests of an applicant within its class, 
+ * scheduled by deficit round robin.
+ */
+struct sod_flow {
+    TAILQ_ENTRY(sod_flow)     fl_next;
+    uid_t     fl_uid;
+    struct sod_peer     *fl_pr;
+    int     fl_deficit;
+    struct sod_req_list     fl_queue;
+};
+TAILQ_HEAD(sod_flow_list, sod_flow);
+
+/*
+ * Class of requests with its concurrency budget and queue.
+ */
+struct sod_class {
+    const char     *sk_name;
+    int     sk_max;     /* concurrency budget */
+    int     sk_running;
+    int     sk_qlen;
+    int     sk_nflows;
+    struct sod_flow_list     sk_flows;     /* active, by round */
+    uint64_t     sk_dispatched;
+    uint64_t     sk_wait;     /* accumulated wait time, usec */
+    uint64_t     sk_wait_max;
+};
+
+struct pam_message;
+struct pam_response;
+
+extern struct sod_conf     sod_cf;
+extern struct sod_class     sod_classes[SOD_CLASS_MAX];
+extern int     sod_backlog_max;
+
+#define SOD_HASH_KEYLEN     16
+
+__BEGIN_DECLS
+uint64_t     sod_clock(void);
+uint64_t     sod_siphash(const uint8_t *, const void *, size_t);
+int     sod_cap_open(const char *);
+void     sod_cap_log(struct sod_softc *, int, int);
+int     sod_conv(int, const struct pam_message **, 
+    struct pam_response **, void *);
+int     sod_authtok(struct sod_softc *, const char *, char *);
+ssize_t     sod_xfer(sod_msg_fn_t, struct sod_softc *, int);
+void     sod_detach(void);
+int     sod_audit_open(const char *);
+int     sod_audit_start(void);
+void     sod_audit_detach(void);
+void     sod_audit_reopen(void);
+void     sod_audit_log(const struct sod_req *, const char *, int, uint64_t);
+void     sod_audit_stats(void);
+void     sod_doit(const struct sod_req *);
+int     sod_flight_init(void);
+int     sod_flight_enter(struct sod_softc *);
+void     sod_flight_leave(struct sod_softc *, int);
+void     sod_flight_stats(void);
+void     sod_sched_init(void);
+int     sod_sched_peer(const char *);
+int     sod_sched_enter(int);
+struct pollfd *     sod_sched_pollset(size_t, size_t *);
+void     sod_sched_input(struct pollfd *, size_t);
+void     sod_sched_dispatch(void);
+void     sod_sched_reap(void);
+int     sod_sched_timo(int);
+int     sod_sched_busy(void);
+void     sod_sched_stats(void);
+void     sod_sched_closeall(void);
+void     sod_sched_complete(uint32_t);
+void     sod_sched_lost(int);
+int     sod_shard_init(int);
+int     sod_shard_count(void);
+int     sod_shard_dispatch(struct sod_req *);
+void     sod_shard_pollset(struct pollfd *);
+void     sod_shard_input(struct pollfd *);
+void     sod_shard_stats(void);
+__END_DECLS
+
+#endif /* _SOD_VAR_H_ */
@@ -0,0 +1,631 @@
+/*-
+ * Copyright (c) 2015, 2016 Henning Matyschok
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * version=0.3
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sod.h>
+
+#include "extern.h"
+#include "sod_rec.h"
+
+/*
+ * Replay of by sod(8) captured transactions.
+ *
+ * Transactions are started and messages are sent by applicant 
+ * after the same delay as captured, divided by speed. Records 
+ * are grouped into transactions by instance of sod(8), by
+ * connection and by transaction within a session, where any 
+ * transaction is replayed on a connection of its own by a bounded 
+ * pool of workers. A transaction started late, because any worker 
+ * was busy, is counted as delayed. Captured usernames of an instance 
+ * are mapped on by credentials file given accounts, in order of their 
+ * first appearance. Any line of the credentials file denotes user, 
+ * password and optionally a new password for password changes.
+ *
+ * Responses to prompts are replayed by their captured ordinal among 
+ * distinct responses of the transaction. During authentication, a 
+ * response is replayed as valid password, if accepted during capture, 
+ * otherwise an invalid password is sent. During a password change, the 
+ * first distinct response is replayed as password, the second as new 
+ * password and any further one as invalid password, thus a retyped 
+ * new password matches and a mistyped one does not. For any response 
+ * of sod(8), its latency is compared with the captured one.
+ */
+
+#define SOD_REPLAY_LATE     1000     /* usec, until delayed */
+
+struct sod_cred {
+    char     sc_user[SOD_NMAX + 1];
+    char     sc_pw[SOD_NMAX + 1];
+    char     sc_new[SOD_NMAX + 1];     /* by password change */
+};
+
+struct sod_user {
+    uint32_t     su_inst;
+    uint32_t     su_hash;
+    struct sod_cred     *su_cred;
+};
+
+struct sod_txn {
+    struct sod_cap_rec     *st_rec;
+    size_t     st_nrec;
+    struct sod_cred     *st_cred;
+    uint64_t     st_t0;     /* scheduled start */
+};
+
+/*
+ * Latency of response, during capture and replay.
+ */
+struct sod_sample {
+    int64_t     ss_cap;
+    int64_t     ss_replay;
+};
+
+static struct sockaddr_storage     sap;
+static struct sockaddr_un *sun;
+static size_t len;
+
+static double     sod_speed;
+
+static pthread_mutex_t     sod_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     sod_cv = PTHREAD_COND_INITIALIZER;
+static struct sod_txn     *sod_txns;
+static size_t     sod_posted;     /* by dispatcher */
+static size_t     sod_taken;     /* by workers */
+static int     sod_closed;
+static size_t     sod_delayed;
+static struct sod_sample     *sod_samples;
+static size_t     sod_nsamples;
+static size_t     sod_maxsamples;
+static size_t     sod_mismatch;
+static size_t     sod_failed;
+
+static void *     sod_replay_worker(void *);
+static void     sod_replay_txn(struct sod_txn *);
+static const char *     sod_replay_tok(const struct sod_txn *, size_t, 
+    char *, size_t);
+static const char *     sod_replay_bad(char *, size_t, unsigned int, 
+    const char *);
+static void     sod_replay_sample(int64_t, int64_t, int);
+static void     sod_replay_report(size_t, int);
+static uint64_t     sod_replay_clock(void);
+static void     sod_replay_sleep(uint64_t);
+static int     sod_replay_reccmp(const void *, const void *);
+static int     sod_replay_i64cmp(const void *, const void *);
+
+/*
+ * Replay capture by sod(8) listening on sod_test_sock.
+ */
+void
+sod_replay(const char *cap, const char *cred, double speed, int workers)
+{
+    struct sod_cap_hdr ch;
+    struct sod_cap_rec *rec, *tmp, **ord;
+    struct sod_cred *sc;
+    struct sod_user *su;
+    struct sod_txn *st;
+    pthread_t *tid;
+    char line[3 * (SOD_NMAX + 1) + 2], *u, *p, *np;
+    size_t nrec, maxrec, ncred, maxcred, nuser, ntxn, i, j, k;
+    uint64_t t0, c0;
+    FILE *fp;
+    
+    sod_speed = speed;
+/*
+ * Read credentials.
+ */    
+    if ((fp = fopen(cred, "r")) == NULL)
+        err(EX_NOINPUT, "Can't open %s", cred);
+    
+    sc = NULL;
+    ncred = maxcred = 0;
+    
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((u = strtok(line, " \t\n")) == NULL || *u == '#')
+            continue;
+        
+        if ((p = strtok(NULL, " \t\n")) == NULL)
+            errx(EX_DATAERR, "%s: Missing password of %s", cred, u);
+        
+        if (ncred == maxcred) {
+            maxcred = (maxcred > 0) ? maxcred * 2 : 16;
+            
+            if ((sc = reallocarray(sc, maxcred, sizeof(*sc))) == NULL)
+                err(EX_OSERR, "Can't allocate credentials");
+        }
+        (void)memset(&sc[ncred], 0, sizeof(*sc));
+        (void)strncpy(sc[ncred].sc_user, u, SOD_NMAX);
+        (void)strncpy(sc[ncred].sc_pw, p, SOD_NMAX);
+/*
+ * Password remains unchanged, if no new one is given.
+ */        
+        if ((np = strtok(NULL, " \t\n")) == NULL)
+            np = p;
+        
+        (void)strncpy(sc[ncred].sc_new, np, SOD_NMAX);
+        ncred++;
+    }
+    (void)fclose(fp);
+    
+    if (ncred == 0)
+        errx(EX_DATAERR, "%s: No credentials", cred);
+/*
+ * Read capture.
+ */    
+    if ((fp = fopen(cap, "r")) == NULL)
+        err(EX_NOINPUT, "Can't open %s", cap);
+    
+    if (fread(&ch, sizeof(ch), 1, fp) != 1 
+        || ch.ch_magic != SOD_CAP_MAGIC 
+        || ch.ch_version != SOD_CAP_VERSION)
+        errx(EX_DATAERR, "%s: Not a capture file", cap);
+    
+    rec = NULL;
+    nrec = maxrec = 0;
+    
+    for (;;) {
+        if (nrec == maxrec) {
+            maxrec = (maxrec > 0) ? maxrec * 2 : 1024;
+            
+            if ((rec = reallocarray(rec, maxrec, sizeof(*rec))) == NULL)
+                err(EX_OSERR, "Can't allocate records");
+        }
+        
+        if (fread(&rec[nrec], sizeof(*rec), 1, fp) != 1)
+            break;
+        
+        nrec++;
+    }
+    (void)fclose(fp);
+    
+    if (nrec == 0)
+        errx(EX_DATAERR, "%s: No records", cap);
+/*
+ * Group by instance and transaction. Within a transaction, records 
+ * are kept in order of capture, because those were written by the 
+ * same child, where timestamps of subsequent messages may be equal.
+ */    
+    if ((ord = calloc(nrec, sizeof(*ord))) == NULL 
+        || (tmp = calloc(nrec, sizeof(*tmp))) == NULL)
+        err(EX_OSERR, "Can't allocate records");
+    
+    for (i = 0; i < nrec; i++)
+        ord[i] = &rec[i];
+    
+    qsort(ord, nrec, sizeof(*ord), sod_replay_reccmp);
+    
+    for (i = 0; i < nrec; i++)
+        tmp[i] = *ord[i];
+    
+    free(ord);
+    free(rec);
+    rec = tmp;
+    
+    if ((st = calloc(nrec, sizeof(*st))) == NULL 
+        || (su = calloc(nrec, sizeof(*su))) == NULL)
+        err(EX_OSERR, "Can't allocate transactions");
+    
+    for (ntxn = nuser = i = 0; i < nrec; i = j) {
+        for (j = i + 1; j < nrec; j++) {
+            if (rec[j].cr_inst != rec[i].cr_inst 
+                || rec[j].cr_txn != rec[i].cr_txn
+                || rec[j].cr_seq != rec[i].cr_seq)
+                break;
+        }
+        st[ntxn].st_rec = &rec[i];
+        st[ntxn].st_nrec = j - i;
+        
+        for (k = 0; k < nuser; k++) {
+            if (su[k].su_inst == rec[i].cr_inst 
+                && su[k].su_hash == rec[i].cr_user)
+                break;
+        }
+        
+        if (k == nuser) {
+            su[k].su_inst = rec[i].cr_inst;
+            su[k].su_hash = rec[i].cr_user;
+            su[k].su_cred = &sc[nuser % ncred];
+            nuser++;
+        }
+        st[ntxn].st_cred = su[k].su_cred;
+        ntxn++;
+    }
+/*
+ * Start transactions in order of their first record.
+ */
+    for (i = 1; i < ntxn; i++) {
+        struct sod_txn cur = st[i];
+        
+        for (j = i; j > 0 && st[j - 1].st_rec[0].cr_time > 
+            cur.st_rec[0].cr_time; j--)
+            st[j] = st[j - 1];
+        
+        st[j] = cur;
+    }
+    
+    (void)memset(&sap, 0, sizeof(sap));
+    
+    sun = (struct sockaddr_un *)&sap;
+    sun->sun_family = AF_UNIX;
+    len = sizeof(sun->sun_path);
+    
+    (void)strncpy(sun->sun_path, sod_test_sock, len - 1);
+
+    len += offsetof(struct sockaddr_un, sun_path);
+    
+/*
+ * Start pool, its workers await posted transactions.
+ */    
+    if ((size_t)workers > ntxn)
+        workers = (int)ntxn;
+    
+    if ((tid = calloc((size_t)workers, sizeof(*tid))) == NULL)
+        err(EX_OSERR, "Can't allocate workers");
+    
+    sod_txns = st;
+    
+    for (k = 0; k < (size_t)workers; k++) {
+        if (pthread_create(&tid[k], NULL, sod_replay_worker, NULL) != 0)
+            errx(EX_OSERR, "Can't create pthread(3)");
+    }
+    
+    t0 = sod_replay_clock();
+    c0 = st[0].st_rec[0].cr_time;
+    
+    for (i = 0; i < ntxn; i++) {
+        st[i].st_t0 = t0 + 
+            (uint64_t)((st[i].st_rec[0].cr_time - c0) / sod_speed);
+        
+        sod_replay_sleep(st[i].st_t0);
+        
+        (void)pthread_mutex_lock(&sod_mtx);
+        sod_posted = i + 1;
+        (void)pthread_cond_signal(&sod_cv);
+        (void)pthread_mutex_unlock(&sod_mtx);
+    }
+    
+    (void)pthread_mutex_lock(&sod_mtx);
+    sod_closed = 1;
+    (void)pthread_cond_broadcast(&sod_cv);
+    (void)pthread_mutex_unlock(&sod_mtx);
+    
+    for (k = 0; k < (size_t)workers; k++) 
+        (void)pthread_join(tid[k], NULL);
+    
+    free(tid);
+    
+    sod_replay_report(ntxn, workers);
+    
+    free(su);
+    free(st);
+    free(rec);
+    free(sc);
+}
+
+/*
+ * By pthread(3) called start routine, replays posted 
+ * transactions until the dispatcher is closed.
+ */
+static void *
+sod_replay_worker(void *arg __unused)
+{
+    struct sod_txn *st;
+    
+    for (;;) {
+        (void)pthread_mutex_lock(&sod_mtx);
+        
+        while (sod_taken == sod_posted && sod_closed == 0)
+            (void)pthread_cond_wait(&sod_cv, &sod_mtx);
+        
+        if (sod_taken == sod_posted) {
+            (void)pthread_mutex_unlock(&sod_mtx);
+            break;
+        }
+        st = &sod_txns[sod_taken++];
+        
+        if (sod_replay_clock() - st->st_t0 > SOD_REPLAY_LATE)
+            sod_delayed++;
+        
+        (void)pthread_mutex_unlock(&sod_mtx);
+        
+        sod_replay_txn(st);
+    }
+    return (NULL);
+}
+
+/*
+ * Replay transaction.
+ */
+static void
+sod_replay_txn(struct sod_txn *st)
+{
+    struct sod_cap_rec *cr;
+    struct sod_msg buf;
+    uint64_t t, t_last, t_send, c_last, c_send;
+    char bad[SOD_NMAX + 1];
+    const char *tok;
+    size_t i;
+    int s;
+    
+    if ((s = socket(sun->sun_family, SOCK_STREAM, 0)) < 0) 
+        goto bad;
+    
+    if (connect(s, (struct sockaddr *)sun, len) < 0) {
+        (void)close(s);
+        goto bad;
+    }
+    
+    t_last = t_send = sod_replay_clock();
+    c_last = c_send = st->st_rec[0].cr_time;
+    
+    for (i = 0; i < st->st_nrec; i++) {
+        cr = &st->st_rec[i];
+        
+        if (cr->cr_dir == SOD_CAP_IN) {
+/*
+ * Think time of applicant.
+ */            
+            sod_replay_sleep(t_last + 
+                (uint64_t)((cr->cr_time - c_last) / sod_speed));
+            
+            tok = sod_replay_tok(st, i, bad, sizeof(bad));
+            
+            sod_msg_prepare(tok, cr->cr_code, &buf);
+            
+            if (sod_msg_fn(sod_msg_send, s, &buf) < 0) 
+                break;
+            
+            t_last = t_send = sod_replay_clock();
+            c_last = c_send = cr->cr_time;
+        } else {
+            if (sod_msg_fn(sod_msg_recv, s, &buf) <= 0) 
+                break;
+            
+            t_last = t = sod_replay_clock();
+            c_last = cr->cr_time;
+            
+            sod_replay_sample((int64_t)(cr->cr_time - c_send), 
+                (int64_t)(t - t_send), buf.sm_code != cr->cr_code);
+        }
+    }
+    (void)memset(&buf, 0, sizeof(buf));
+    (void)close(s);
+    
+    if (i == st->st_nrec)
+        return;
+bad:
+    (void)pthread_mutex_lock(&sod_mtx);
+    sod_failed++;
+    (void)pthread_mutex_unlock(&sod_mtx);
+}
+
+/*
+ * Select token of i-th record by its class and ordinal.
+ */
+static const char *
+sod_replay_tok(const struct sod_txn *st, size_t i, char *bad, size_t size)
+{
+    const struct sod_cap_rec *cr = &st->st_rec[i], *rr;
+    size_t j, k;
+    
+    switch (cr->cr_tok) {
+    case SOD_CAP_TOK_USER:
+        return (st->st_cred->sc_user);
+    case SOD_CAP_TOK_AUTHTOK:
+        break;
+    default:
+        return (NULL);
+    }
+    
+    if (st->st_rec[0].cr_code == SOD_PASSWD_REQ) {
+        switch (cr->cr_ord) {
+        case 0:
+        case 1:
+            return (st->st_cred->sc_pw);
+        case 2:
+            return (st->st_cred->sc_new);
+        default:
+            return (sod_replay_bad(bad, size, cr->cr_ord, 
+                st->st_cred->sc_new));
+        }
+    }
+/*
+ * Valid, if the response of sod(8) to this or to any 
+ * identical one acknowledges authentication.
+ */    
+    for (j = 0; j < st->st_nrec; j++) {
+        rr = &st->st_rec[j];
+        
+        if (rr->cr_dir != SOD_CAP_IN || rr->cr_tok != SOD_CAP_TOK_AUTHTOK 
+            || (j != i && (cr->cr_ord == 0 || rr->cr_ord != cr->cr_ord)))
+            continue;
+        
+        for (k = j + 1; k < st->st_nrec; k++) {
+            if (st->st_rec[k].cr_dir == SOD_CAP_OUT)
+                break;
+        }
+        
+        if (k < st->st_nrec && st->st_rec[k].cr_code == SOD_AUTH_ACK)
+            return (st->st_cred->sc_pw);
+    }
+    return (sod_replay_bad(bad, size, cr->cr_ord, st->st_cred->sc_pw));
+}
+
+/*
+ * Invalid password, differs from pw by prefix denoting 
+ * its ordinal, truncated to size.
+ */
+static const char *
+sod_replay_bad(char *bad, size_t size, unsigned int ord, const char *pw)
+{
+    size_t n;
+    
+    n = strnlen(pw, size - 3);
+    
+    bad[0] = '!';
+    bad[1] = (char)('0' + ord % 10);
+    (void)memcpy(bad + 2, pw, n);
+    bad[n + 2] = '\0';
+    
+    return (bad);
+}
+
+static void
+sod_replay_sample(int64_t cap, int64_t replay, int mismatch)
+{
+    struct sod_sample *ss;
+    
+    (void)pthread_mutex_lock(&sod_mtx);
+    
+    if (sod_nsamples == sod_maxsamples) {
+        sod_maxsamples = (sod_maxsamples > 0) ? sod_maxsamples * 2 : 1024;
+        
+        if ((ss = reallocarray(sod_samples, sod_maxsamples, 
+            sizeof(*ss))) == NULL)
+            err(EX_OSERR, "Can't allocate samples");
+        
+        sod_samples = ss;
+    }
+    sod_samples[sod_nsamples].ss_cap = cap;
+    sod_samples[sod_nsamples].ss_replay = replay;
+    sod_nsamples++;
+    
+    if (mismatch != 0)
+        sod_mismatch++;
+    
+    (void)pthread_mutex_unlock(&sod_mtx);
+}
+
+/*
+ * Report latency divergence, in usec.
+ */
+static void
+sod_replay_report(size_t ntxn, int workers)
+{
+    int64_t *d, cap, replay;
+    size_t i, n;
+    
+    n = sod_nsamples;
+    
+    (void)printf("transactions=%zu failed=%zu delayed=%zu responses=%zu "
+        "mismatched=%zu speed=%g workers=%d\n", ntxn, sod_failed, 
+        sod_delayed, n, sod_mismatch, sod_speed, workers);
+    
+    if (n == 0)
+        return;
+    
+    if ((d = calloc(n, sizeof(*d))) == NULL)
+        err(EX_OSERR, "Can't allocate samples");
+    
+    for (cap = replay = 0, i = 0; i < n; i++) {
+        cap += sod_samples[i].ss_cap;
+        replay += sod_samples[i].ss_replay;
+        d[i] = sod_samples[i].ss_replay - sod_samples[i].ss_cap;
+    }
+    qsort(d, n, sizeof(*d), sod_replay_i64cmp);
+    
+    (void)printf("latency_capture_avg=%jd latency_replay_avg=%jd\n", 
+        (intmax_t)(cap / (int64_t)n), (intmax_t)(replay / (int64_t)n));
+    (void)printf("divergence_min=%jd divergence_p50=%jd "
+        "divergence_p90=%jd divergence_p99=%jd divergence_max=%jd\n", 
+        (intmax_t)d[0], (intmax_t)d[n / 2], (intmax_t)d[n * 9 / 10], 
+        (intmax_t)d[n * 99 / 100], (intmax_t)d[n - 1]);
+    
+    free(d);
+    free(sod_samples);
+    sod_samples = NULL;
+}
+
+/*
+ * Monotonic clock, in usec.
+ */
+static uint64_t
+sod_replay_clock(void)
+{
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return (0);
+    
+    return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+/*
+ * Sleep until deadline, in usec.
+ */
+static void
+sod_replay_sleep(uint64_t t)
+{
+    struct timespec ts;
+    
+    ts.tv_sec = (time_t)(t / 1000000);
+    ts.tv_nsec = (long)(t % 1000000) * 1000;
+    
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) 
+        == EINTR)
+        continue;
+}
+
+static int
+sod_replay_reccmp(const void *a, const void *b)
+{
+    const struct sod_cap_rec *x = *(struct sod_cap_rec * const *)a;
+    const struct sod_cap_rec *y = *(struct sod_cap_rec * const *)b;
+    
+    if (x->cr_inst != y->cr_inst)
+        return ((x->cr_inst < y->cr_inst) ? -1 : 1);
+    
+    if (x->cr_txn != y->cr_txn)
+        return ((x->cr_txn < y->cr_txn) ? -1 : 1);
+    
+    if (x->cr_seq != y->cr_seq)
+        return ((x->cr_seq < y->cr_seq) ? -1 : 1);
+    
+    return ((x < y) ? -1 : (x > y));
+}
+
+static int
+sod_replay_i64cmp(const void *a, const void *b)
+{
+    const int64_t *x = a, *y = b;
+    
+    return ((*x < *y) ? -1 : (*x > *y));
+}
@@ -41,6 +41,8 @@
 
 #include <sod.h>
 
+#include "extern.h"
+
 /*
  * Simple test.
  */
@@ -51,13 +53,21 @@ struct sod_test_args {
 };
 #define SOD_TEST_MAX_ARG    3
 
+#define SOD_TEST_WORKERS_DFLT     64     /* by replay */
+#define SOD_TEST_WORKERS_MAX     4096
+
 static char     sod_test_progname[SOD_NMAX + 1];
+const char     *sod_test_sock = SOD_SOCK_FILE;
+static long     sod_test_ring;     /* transactions by shared memory */
 
 static struct sockaddr_storage     sap;
 static struct sockaddr_un *sun;
 static size_t len;
 
 static void *   sod_test(void *);
+static ssize_t     sod_test_xfer(sod_msg_fn_t, int, struct sod_ring *, 
+    struct sod_msg *);
+static void     sod_test_usage(void);
 
 /*
  * By pthread(3) called start routine.
@@ -66,8 +76,10 @@ void *
 sod_test(void *arg)
 {
     struct sod_test_args *sta;
+    struct sod_ring *rg = NULL;
     struct sod_msg buf;
     int s, state;
+    long n = 0;
     char *tok;
     
     if ((sta = arg) == NULL)
@@ -80,8 +92,18 @@ sod_test(void *arg)
     
     if (connect(s, (struct sockaddr *)sun, len) < 0)
         goto bad;
-
-    state = SOD_AUTH_REQ;+
+/*
+ * Perform handshake, if transport by shared memory is used.
+ */    
+    if (sod_test_ring > 0) {
+        if ((rg = sod_ring_create(s)) == NULL) {
+            (void)printf("Can't establish ring\n");
+            goto bad;
+        }
+        (void)printf("Received SOD_RING_ACK\n");
+    }
+again:
+    state = SOD_AUTH_REQ;
     tok = sta->sta_user;
     
     while (state) {
@@ -97,7 +119,7 @@ sod_test(void *arg)
 /*
  * Send message.
  */         
-            if (sod_msg_fn(sod_msg_send, s, &buf) < 0) {
+            if (sod_test_xfer(sod_msg_send, s, rg, &buf) < 0) {
                 (void)printf("Can't send PAM_USER as request\n");
                 state = 0;
                 break;
@@ -110,7 +132,7 @@ sod_test(void *arg)
 /*
  * Await response.
  */            
-            if (sod_msg_fn(sod_msg_recv, s, &buf) < 0) {
+            if (sod_test_xfer(sod_msg_recv, s, rg, &buf) <= 0) {
                 (void)printf("Can't receive response");
                 state = 0;
                 break;
@@ -141,11 +163,32 @@ sod_test(void *arg)
             break;
         }
     }
-
+    
+    if (++n < sod_test_ring)
+        goto again;
+    
+    sod_ring_free(rg);
 bad:
     return (NULL);
 }
 
+/*
+ * Exchange message by socket or by shared memory.
+ */
+static ssize_t 
+sod_test_xfer(sod_msg_fn_t fn, int s, struct sod_ring *rg, 
+        struct sod_msg *sm)
+{
+    
+    if (rg == NULL)
+        return (sod_msg_fn(fn, s, sm));
+    
+    if (fn == sod_msg_send)
+        return (sod_ring_send(rg, sm));
+    
+    return (sod_ring_recv(rg, sm));
+}
+
 /*
  * Establish connection with sod.
  */
@@ -156,6 +199,11 @@ main(int argc, char **argv)
     struct sigaction sa;
     struct sod_test_args sta;
     pthread_t tid;
+    const char *cap = NULL, *cred = NULL;
+    double speed = 1.0;
+    long workers = SOD_TEST_WORKERS_DFLT;
+    char *ep;
+    int ch;
     
     sa.sa_handler = SIG_IGN;
     (void)sigemptyset(&sa.sa_mask);
@@ -165,15 +213,63 @@ main(int argc, char **argv)
         errx(EX_OSERR, "Can't disable SIGCHLD");
 
     (void)strncpy(sod_test_progname, argv[0], SOD_NMAX);
+    
+    while ((ch = getopt(argc, argv, "R:S:c:r:s:w:")) != -1) {
+        switch (ch) {
+        case 'R':
+            sod_test_ring = strtol(optarg, &ep, 10);
+            
+            if (*optarg == '\0' || *ep != '\0' || sod_test_ring < 1)
+                sod_test_usage();
+            break;
+        case 'S':
+            sod_test_sock = optarg;
+            break;
+        case 'c':
+            cred = optarg;
+            break;
+        case 'r':
+            cap = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, &ep);
+            
+            if (*optarg == '\0' || *ep != '\0' || speed <= 0.0)
+                sod_test_usage();
+            break;
+        case 'w':
+            workers = strtol(optarg, &ep, 10);
+            
+            if (*optarg == '\0' || *ep != '\0' || workers < 1 
+                || workers > SOD_TEST_WORKERS_MAX)
+                sod_test_usage();
+            break;
+        default:
+            sod_test_usage();
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+/*
+ * Replay capture, see sod_replay.c.
+ */    
+    if (cap != NULL) {
+        if (cred == NULL || argc != 0)
+            sod_test_usage();
         
-    if (argc != SOD_TEST_MAX_ARG)
-        errx(EX_USAGE, "\nusage: %s user pw\n", argv[0]);
+        sod_replay(cap, cred, speed, (int)workers);
+        exit(EX_OK);
+    }
+        
+    if (argc != SOD_TEST_MAX_ARG - 1)
+        sod_test_usage();
 /*
  * Cache arguments and prepare buffer.
  */        
     (void)memset(&sta, 0, sizeof(sta));
-    (void)strncpy(sta.sta_user, argv[1], SOD_NMAX);
-    (void)strncpy(sta.sta_pw, argv[2], SOD_NMAX);    
+    (void)strncpy(sta.sta_user, argv[0], SOD_NMAX);
+    (void)strncpy(sta.sta_pw, argv[1], SOD_NMAX);    
     (void)memset(&sap, 0, sizeof(sap));
 /*
  * Create socket address.
@@ -182,7 +278,7 @@ main(int argc, char **argv)
     sun->sun_family = AF_UNIX;
     len = sizeof(sun->sun_path);
     
-    (void)strncpy(sun->sun_path, SOD_SOCK_FILE, len - 1);
+    (void)strncpy(sun->sun_path, sod_test_sock, len - 1);
 
     len += offsetof(struct sockaddr_un, sun_path);
 /*
@@ -200,3 +296,12 @@ main(int argc, char **argv)
     exit(EX_OK);
 }
 
+static void
+sod_test_usage(void)
+{
+    
+    errx(EX_USAGE, "\nusage: %s [-R count] [-S socket] user pw\n"
+        "       %s [-S socket] -r capture -c credentials [-s speed] "
+        "[-w workers]\n", 
+        sod_test_progname, sod_test_progname);
+}